@@ -0,0 +1,202 @@
+/* TCP client pool
+ *
+ * This file may be distributed and/or modified under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation and appearing in the file LICENSE.GPL included in the
+ * packaging of this file.
+ *
+ * This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+ * WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * See COPYING for GPL licensing information.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mini_snmpd.h"
+
+/*
+ * Client control structures are carved from slabs and recycled through a
+ * free list, so connects and disconnects are O(1) and never free memory.
+ * The same goes for the stream buffers, which a client only holds while it
+ * has data in flight; an idle connection costs just its client_t.
+ *
+ * Connected clients are kept in g_tcp_client_list, ordered by the time they
+ * were queued.  Activity only updates the client's timestamp, the client is
+ * moved to the tail lazily when it reaches the head.  Hence the head is
+ * always the least recently active client once stale entries are requeued,
+ * which makes both eviction and idle timeout amortized O(1).
+ */
+#define CLIENT_SLAB_SIZE                                16
+#define BUFFER_SLAB_SIZE                                8
+
+typedef union buffer_u {
+	union buffer_u *next;
+	unsigned char   data[MAX_TCP_BUFFER_SIZE];
+} buffer_t;
+
+static client_t *m_free_clients;
+static buffer_t *m_free_buffers;
+static client_t *m_tail;
+
+static int client_slab_alloc(void)
+{
+	size_t i;
+	client_t *slab;
+
+	slab = allocate(CLIENT_SLAB_SIZE * sizeof(client_t));
+	if (!slab)
+		return -1;
+
+	for (i = 0; i < CLIENT_SLAB_SIZE; i++) {
+		slab[i].next = m_free_clients;
+		m_free_clients = &slab[i];
+	}
+
+	return 0;
+}
+
+static int buffer_slab_alloc(void)
+{
+	size_t i;
+	buffer_t *slab;
+
+	slab = allocate(BUFFER_SLAB_SIZE * sizeof(buffer_t));
+	if (!slab)
+		return -1;
+
+	for (i = 0; i < BUFFER_SLAB_SIZE; i++) {
+		slab[i].next = m_free_buffers;
+		m_free_buffers = &slab[i];
+	}
+
+	return 0;
+}
+
+static void client_link(client_t *client)
+{
+	client->queued = client->timestamp;
+	client->next = NULL;
+	client->prev = m_tail;
+	if (m_tail)
+		m_tail->next = client;
+	else
+		g_tcp_client_list = client;
+	m_tail = client;
+}
+
+static void client_unlink(client_t *client)
+{
+	if (client->prev)
+		client->prev->next = client->next;
+	else
+		g_tcp_client_list = client->next;
+
+	if (client->next)
+		client->next->prev = client->prev;
+	else
+		m_tail = client->prev;
+}
+
+/* Requeue clients at the head that have seen activity since being queued */
+static client_t *client_head(void)
+{
+	client_t *client;
+
+	while ((client = g_tcp_client_list) && client->timestamp != client->queued) {
+		if (client == m_tail) {
+			client->queued = client->timestamp;
+			break;
+		}
+
+		client_unlink(client);
+		client_link(client);
+	}
+
+	return client;
+}
+
+client_t *tcp_client_alloc(void)
+{
+	client_t *client;
+	unsigned int gen;
+
+	if (!m_free_clients && client_slab_alloc())
+		return NULL;
+
+	client = m_free_clients;
+	m_free_clients = client->next;
+
+	/* Bump the generation, responses still with the workers are for the previous user */
+	gen = client->gen + 1;
+	memset(client, 0, sizeof(*client));
+	client->gen = gen;
+	client->sockfd = -1;
+	client->timestamp = monotonic_time();
+	client_link(client);
+	g_tcp_client_list_length++;
+
+	return client;
+}
+
+void tcp_client_free(client_t *client)
+{
+	tcp_buffer_put(client->rbuf);
+	tcp_buffer_put(client->wbuf);
+	client->rbuf = NULL;
+	client->wbuf = NULL;
+
+	client_unlink(client);
+	g_tcp_client_list_length--;
+
+	client->sockfd = -1;
+	client->prev = NULL;
+	client->next = m_free_clients;
+	m_free_clients = client;
+}
+
+/* The least recently active client, candidate for eviction */
+client_t *tcp_client_oldest(void)
+{
+	return client_head();
+}
+
+/* The least recently active client, if it has been idle since before @when */
+client_t *tcp_client_expired(time_t when)
+{
+	client_t *client = client_head();
+
+	if (client && client->timestamp < when)
+		return client;
+
+	return NULL;
+}
+
+unsigned char *tcp_buffer_get(void)
+{
+	buffer_t *buf;
+
+	if (!m_free_buffers && buffer_slab_alloc())
+		return NULL;
+
+	buf = m_free_buffers;
+	m_free_buffers = buf->next;
+
+	return buf->data;
+}
+
+void tcp_buffer_put(unsigned char *data)
+{
+	buffer_t *buf = (buffer_t *)data;
+
+	if (!buf)
+		return;
+
+	buf->next = m_free_buffers;
+	m_free_buffers = buf;
+}
+
+/* vim: ts=4 sts=4 sw=4 nowrap
+ */
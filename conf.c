@@ -59,9 +59,29 @@ int read_config(char *file)
 		CFG_BOOL("authentication", g_auth, CFGF_NONE),
 		CFG_STR ("community", NULL, CFGF_NONE),
 		CFG_INT ("timeout", g_timeout, CFGF_NONE),
+		CFG_INT ("max-staleness", g_max_staleness, CFGF_NONE),
+		CFG_INT ("tcp-max-clients", g_tcp_max_clients, CFGF_NONE),
+		CFG_INT ("tcp-idle-timeout", g_tcp_idle_timeout, CFGF_NONE),
+		CFG_INT ("udp-rcvbuf", g_udp_rcvbuf, CFGF_NONE),
+		CFG_INT ("udp-sndbuf", g_udp_sndbuf, CFGF_NONE),
+		CFG_INT ("dedup-window", g_dedup_window, CFGF_NONE),
+		CFG_INT ("shed-watermark", g_shed_watermark, CFGF_NONE),
+		CFG_INT ("bulk-varbinds", g_bulk_varbinds, CFGF_NONE),
+		CFG_INT ("bulk-bytes", g_bulk_bytes, CFGF_NONE),
+		CFG_INT ("bulk-time", g_bulk_time, CFGF_NONE),
 		CFG_STR ("vendor", VENDOR, CFGF_NONE),
 		CFG_STR_LIST("disk-table", "/", CFGF_NONE),
 		CFG_STR_LIST("iface-table", NULL, CFGF_NONE),
+#ifdef __linux__
+		CFG_BOOL("iface-auto", g_interface_auto, CFGF_NONE),
+		CFG_BOOL("low-latency", g_low_latency, CFGF_NONE),
+		CFG_INT ("cpu", g_cpu, CFGF_NONE),
+		CFG_INT ("realtime", g_realtime, CFGF_NONE),
+		CFG_INT ("workers", g_workers, CFGF_NONE),
+#endif
+#ifdef CONFIG_ENABLE_IO_URING
+		CFG_BOOL("io-uring", g_io_uring, CFGF_NONE),
+#endif
 		CFG_END()
 	};
 
@@ -97,10 +117,37 @@ int read_config(char *file)
 
 	g_disk_list_length = get_list(cfg, "disk-table", g_disk_list, NELEMS(g_disk_list));
 	g_interface_list_length = get_list(cfg, "iface-table", g_interface_list, NELEMS(g_interface_list));
+#ifdef __linux__
+	g_interface_auto = cfg_getbool(cfg, "iface-auto");
+
+	g_low_latency = cfg_getbool(cfg, "low-latency");
+	g_cpu         = cfg_getint(cfg, "cpu");
+	g_realtime    = cfg_getint(cfg, "realtime");
+	g_workers     = cfg_getint(cfg, "workers");
+#endif
 
 	g_auth        = cfg_getbool(cfg, "authentication");
 	g_community   = get_string(cfg, "community");
 	g_timeout     = cfg_getint(cfg, "timeout");
+	g_max_staleness = cfg_getint(cfg, "max-staleness");
+
+	if (cfg_getint(cfg, "tcp-max-clients") <= 0) {
+		lprintf(LOG_ERR, "Invalid tcp-max-clients in %s\n", file);
+		rc = 1;
+		goto error;
+	}
+	g_tcp_max_clients  = cfg_getint(cfg, "tcp-max-clients");
+	g_tcp_idle_timeout = cfg_getint(cfg, "tcp-idle-timeout");
+	g_udp_rcvbuf       = cfg_getint(cfg, "udp-rcvbuf");
+	g_udp_sndbuf       = cfg_getint(cfg, "udp-sndbuf");
+	g_dedup_window     = cfg_getint(cfg, "dedup-window");
+	g_shed_watermark   = cfg_getint(cfg, "shed-watermark");
+	g_bulk_varbinds    = cfg_getint(cfg, "bulk-varbinds");
+	g_bulk_bytes       = cfg_getint(cfg, "bulk-bytes");
+	g_bulk_time        = cfg_getint(cfg, "bulk-time");
+#ifdef CONFIG_ENABLE_IO_URING
+	g_io_uring         = cfg_getbool(cfg, "io-uring");
+#endif
 
 	g_vendor      = get_string(cfg, "vendor");
 
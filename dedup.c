@@ -0,0 +1,189 @@
+/* Retransmitted UDP request detection
+ *
+ * This file may be distributed and/or modified under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation and appearing in the file LICENSE.GPL included in the
+ * packaging of this file.
+ *
+ * This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+ * WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * See COPYING for GPL licensing information.
+ */
+
+#include <sys/types.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "mini_snmpd.h"
+
+/*
+ * Managers retransmit a request they got no response to in time with the
+ * same request-id.  Each UDP request is remembered, keyed on its source
+ * and a hash of all of its bytes, which includes the request-id, for
+ * g_dedup_window seconds along with the response sent to it.  A request
+ * seen before, from the same source and with the very same bytes, gets
+ * that response again, without running snmp(), or is dropped while the
+ * original is still with a protocol worker.  The hash only finds the
+ * entry, a request that merely collides with it is handled as usual.
+ *
+ * The table is two-way set associative, on a miss the older entry of the
+ * set is replaced.  Only the event loop uses it.
+ */
+#define DEDUP_SETS                                      64	/* power of 2 */
+#define DEDUP_WAYS                                      2
+
+enum {
+	DEDUP_FREE = 0,
+	DEDUP_PENDING,
+	DEDUP_DONE
+};
+
+typedef struct {
+	uint64_t            hash;
+	time_t              timestamp;
+	struct my_in_addr_t addr;
+	my_in_port_t        port;
+	int                 state;
+	size_t              request_size;
+	unsigned char       request[MAX_PACKET_SIZE];
+	size_t              size;
+	unsigned char       response[MAX_PACKET_SIZE];
+} dedup_t;
+
+static dedup_t *m_dedup;
+
+/* FNV-1a over the request and its source */
+static uint64_t dedup_hash(const client_t *client)
+{
+	const unsigned char *addr = (const unsigned char *)&client->addr;
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < sizeof(client->addr); i++)
+		hash = (hash ^ addr[i]) * 1099511628211ULL;
+	hash = (hash ^ (client->port & 0xff)) * 1099511628211ULL;
+	hash = (hash ^ (client->port >> 8)) * 1099511628211ULL;
+	for (i = 0; i < client->size; i++)
+		hash = (hash ^ client->packet[i]) * 1099511628211ULL;
+
+	/* 0 marks requests that are not in the table */
+	return hash ? hash : 1;
+}
+
+static dedup_t *dedup_find(const client_t *client)
+{
+	dedup_t *set = &m_dedup[(client->hash % DEDUP_SETS) * DEDUP_WAYS];
+	size_t i;
+
+	for (i = 0; i < DEDUP_WAYS; i++) {
+		dedup_t *entry = &set[i];
+
+		if (entry->state != DEDUP_FREE && entry->hash == client->hash &&
+		    entry->port == client->port &&
+		    !memcmp(&entry->addr, &client->addr, sizeof(entry->addr)))
+			return entry;
+	}
+
+	return NULL;
+}
+
+/*
+ * Look up a UDP request before it is handled.  Returns 0 for a new one,
+ * remembered as pending, 1 for a retransmission whose response has been
+ * copied to the client, and -1 for one to drop since the original is still
+ * being handled.
+ */
+int dedup_check(client_t *client)
+{
+	dedup_t *set, *entry;
+	size_t i;
+
+	client->hash = 0;
+	if (g_dedup_window <= 0)
+		return 0;
+
+	if (!m_dedup) {
+		m_dedup = allocate(DEDUP_SETS * DEDUP_WAYS * sizeof(dedup_t));
+		if (!m_dedup) {
+			g_dedup_window = 0;
+			return 0;
+		}
+	}
+
+	client->hash = dedup_hash(client);
+	entry = dedup_find(client);
+	if (entry && (entry->request_size != client->size ||
+		      memcmp(entry->request, client->packet, client->size))) {
+		/*
+		 * Another request with the same hash and source.  Keep this one
+		 * out of the table until that entry is done and expired, so that
+		 * dedup_done() can never mix up their responses.
+		 */
+		if (entry->state == DEDUP_PENDING ||
+		    client->timestamp - entry->timestamp < g_dedup_window) {
+			client->hash = 0;
+			return 0;
+		}
+	} else if (entry && client->timestamp - entry->timestamp < g_dedup_window) {
+		if (entry->state == DEDUP_PENDING) {
+			AGENT_COUNT(dup_drops);
+			return -1;
+		}
+
+		memcpy(client->packet, entry->response, entry->size);
+		client->size = entry->size;
+		client->outgoing = 1;
+		AGENT_COUNT(dup_resends);
+
+		return 1;
+	}
+
+	/* Reuse the expired entry, or a free one, or the older one of the set */
+	if (!entry) {
+		set = &m_dedup[(client->hash % DEDUP_SETS) * DEDUP_WAYS];
+		entry = &set[0];
+		for (i = 1; i < DEDUP_WAYS; i++) {
+			if (entry->state == DEDUP_FREE)
+				break;
+			if (set[i].state == DEDUP_FREE || set[i].timestamp < entry->timestamp)
+				entry = &set[i];
+		}
+	}
+
+	entry->hash = client->hash;
+	entry->timestamp = client->timestamp;
+	entry->addr = client->addr;
+	entry->port = client->port;
+	entry->state = DEDUP_PENDING;
+	entry->request_size = client->size;
+	memcpy(entry->request, client->packet, client->size);
+	entry->size = 0;
+
+	return 0;
+}
+
+/* The response to a request dedup_check() returned 0 for, size 0 if none */
+void dedup_done(const client_t *client)
+{
+	dedup_t *entry;
+
+	if (!client->hash)
+		return;
+
+	entry = dedup_find(client);
+	if (!entry || entry->state != DEDUP_PENDING)
+		return;
+
+	if (client->size == 0 || client->size > sizeof(entry->response)) {
+		entry->state = DEDUP_FREE;
+		return;
+	}
+
+	memcpy(entry->response, client->packet, client->size);
+	entry->size = client->size;
+	entry->state = DEDUP_DONE;
+}
+
+/* vim: ts=4 sts=4 sw=4 nowrap
+ */
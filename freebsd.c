@@ -41,17 +41,6 @@
 
 #include "mini_snmpd.h"
 
-unsigned int get_process_uptime(void)
-{
-	static unsigned int uptime_start = 0;
-	unsigned int uptime_now = get_system_uptime();
-
-	if (uptime_start == 0)
-		uptime_start = uptime_now;
-
-	return uptime_now - uptime_start;
-}
-
 unsigned int get_system_uptime(void)
 {
 #if 1
@@ -60,7 +49,7 @@ unsigned int get_system_uptime(void)
 	if (clock_gettime(CLOCK_UPTIME_PRECISE, &tv))
 		return -1;
 
-	return tv.tv_sec;
+	return timespec_to_ticks(&tv);
 #else
         int             mib[2] = { CTL_KERN, KERN_BOOTTIME };
         size_t          len;
@@ -70,7 +59,7 @@ unsigned int get_system_uptime(void)
         if (0 != sysctl(mib, 2, &uptime, &len, NULL, 0))
                 return -1;
 
-        return time(NULL) - uptime.tv_sec;
+        return (time(NULL) - uptime.tv_sec) * 100;
 #endif
 }
 
@@ -160,9 +149,11 @@ void get_diskinfo(diskinfo_t *diskinfo)
 			diskinfo->used[i]                = 0;
 			diskinfo->blocks_used_percent[i] = 0;
 			diskinfo->inodes_used_percent[i] = 0;
+			diskinfo->device[i][0]           = '\0';
 			continue;
 		}
 
+		snprintf(diskinfo->device[i], sizeof(diskinfo->device[i]), "%s", fs.f_mntfromname);
 		diskinfo->total[i] = ((float)fs.f_blocks * fs.f_bsize) / 1024;
 		diskinfo->free[i]  = ((float)fs.f_bfree  * fs.f_bsize) / 1024;
 		diskinfo->used[i]  = ((float)(fs.f_blocks - fs.f_bfree) * fs.f_bsize) / 1024;
@@ -45,8 +45,18 @@ char     *g_interface_list[MAX_NR_INTERFACES];
 size_t    g_interface_list_length = 0;
 
 #ifdef __linux__
+int       g_interface_auto = 0;
+
 char     *g_wireless_list[MAX_NR_INTERFACES];
 size_t    g_wireless_list_length = 0;
+
+char     *g_diskio_list[MAX_NR_DISKIO];
+size_t    g_diskio_list_length = 0;
+
+int       g_low_latency = 0;
+int       g_cpu = -1;
+int       g_realtime = 0;
+int       g_workers = 0;
 #endif
 
 in_port_t g_udp_port = 161;
@@ -54,12 +64,28 @@ in_port_t g_tcp_port = 161;
 
 int       g_udp_sockfd = -1;
 int       g_tcp_sockfd = -1;
+int       g_udp_rcvbuf = 0;
+int       g_udp_sndbuf = 0;
+int       g_dedup_window = 0;
+int       g_shed_watermark = 0;
+int       g_udp_load = 0;
+int       g_bulk_varbinds = 0;
+int       g_bulk_bytes = 0;
+int       g_bulk_time = 0;
+int       g_max_staleness = 0;
+
+agentinfo_t g_agent;
 
 client_t  g_udp_client = { 0, };
-client_t *g_tcp_client_list[MAX_NR_CLIENTS];
+client_t *g_tcp_client_list = NULL;
 size_t    g_tcp_client_list_length = 0;
+size_t    g_tcp_max_clients = MAX_NR_CLIENTS;
+int       g_tcp_idle_timeout = 0;
+#ifdef CONFIG_ENABLE_IO_URING
+int       g_io_uring = 0;
+#endif
 
-value_t   g_mib[MAX_NR_VALUES];
+value_t  *g_mib = NULL;
 size_t    g_mib_length = 0;
 
 /* vim: ts=4 sts=4 sw=4 nowrap
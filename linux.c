@@ -30,6 +30,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <ctype.h>
 #include <time.h>
 #include <math.h>
@@ -38,31 +41,22 @@
 #define __USE_MISC
 #endif
 #include <linux/wireless.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 
 #include "mini_snmpd.h"
 
 
-/* We need the uptime in 1/100 seconds, so we can't use sysinfo() */
-unsigned int get_process_uptime(void)
-{
-	static unsigned int uptime_start = 0;
-	unsigned int uptime_now = get_system_uptime();
-
-	if (uptime_start == 0)
-		uptime_start = uptime_now;
-
-	return uptime_now - uptime_start;
-}
-
 /* We need the uptime in 1/100 seconds, so we can't use sysinfo() */
 unsigned int get_system_uptime(void)
 {
-	char buf[128];
+	struct timespec ts;
 
-	if (read_file("/proc/uptime", buf, sizeof(buf)) == -1)
+	/* Unlike CLOCK_MONOTONIC this includes time spent suspended, like /proc/uptime */
+	if (clock_gettime(CLOCK_BOOTTIME, &ts))
 		return -1;
 
-	return (unsigned int)(atof(buf) * 100);
+	return timespec_to_ticks(&ts);
 }
 
 void get_loadinfo(loadinfo_t *loadinfo)
@@ -88,6 +82,7 @@ void get_loadinfo(loadinfo_t *loadinfo)
 
 void get_meminfo(meminfo_t *meminfo)
 {
+	static parser_t parser = PARSER_INIT;
 	field_t fields[] = {
 		{ "MemTotal",  1, { &meminfo->total   }},
 		{ "MemFree",   1, { &meminfo->free    }},
@@ -97,12 +92,13 @@ void get_meminfo(meminfo_t *meminfo)
 		{ NULL }
 	};
 
-	if (parse_file("/proc/meminfo", fields))
+	if (parse_file(&parser, "/proc/meminfo", fields))
 		memset(meminfo, 0, sizeof(meminfo_t));
 }
 
 void get_cpuinfo(cpuinfo_t *cpuinfo)
 {
+	static parser_t parser = PARSER_INIT;
 	field_t fields[] = {
 		{ "cpu ",  4, { &cpuinfo->user, &cpuinfo->nice, &cpuinfo->system, &cpuinfo->idle }},
 		{ "intr ", 1, { &cpuinfo->irqs   }},
@@ -110,41 +106,761 @@ void get_cpuinfo(cpuinfo_t *cpuinfo)
 		{ NULL }
 	};
 
-	if (parse_file("/proc/stat", fields))
+	if (parse_file(&parser, "/proc/stat", fields))
 		memset(cpuinfo, 0, sizeof(cpuinfo_t));
 }
 
+/*
+ * Disk usage
+ *
+ * statfs() can block for a long time on NFS, FUSE and other network or
+ * userspace file systems.  Each mount therefore has its own worker thread
+ * calling statfs(), the collector only kicks the idle workers and waits a
+ * few ms for them.  Mounts that do not answer in time report the last good
+ * result, a hung mount only ever stalls its own worker.
+ *
+ * The mount metadata, the device of each mount, is read from
+ * /proc/self/mountinfo only when the kernel reports a change in the mount
+ * table, see mounts_open().
+ */
+#define STATFS_WAIT_MS                                  10
+#define STATFS_TIMEOUT                                  5
+#define STATFS_STACK                                    (64 * 1024)
+
+typedef struct statfs_job_s {
+	pthread_t       thread;
+	pthread_cond_t  wake;
+	int             started;	/* the worker thread is running */
+	int             pending;	/* a statfs() has been requested */
+	int             busy;		/* the worker is in statfs() */
+	int             hung;		/* busy for more than STATFS_TIMEOUT */
+	time_t          since;
+	int             valid;
+	struct statfs   fs;		/* the last good result */
+} statfs_job_t;
+
+static pthread_mutex_t m_statfs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  m_statfs_done;
+static statfs_job_t    m_statfs[MAX_NR_DISKS];
+
+static char m_disk_device[MAX_NR_DISKS][MAX_STRING_SIZE];
+static int  m_mounts_fd = -1;
+
+static void *statfs_worker(void *arg)
+{
+	statfs_job_t *job = arg;
+	const char *path = g_disk_list[job - m_statfs];
+	struct statfs fs;
+	int rc;
+
+	pthread_mutex_lock(&m_statfs_lock);
+	while (1) {
+		while (!job->pending)
+			pthread_cond_wait(&job->wake, &m_statfs_lock);
+		job->pending = 0;
+		job->busy = 1;
+		job->since = monotonic_time();
+		pthread_mutex_unlock(&m_statfs_lock);
+
+		rc = statfs(path, &fs);
+
+		pthread_mutex_lock(&m_statfs_lock);
+		job->busy = 0;
+		job->valid = !rc;
+		if (!rc)
+			job->fs = fs;
+		if (job->hung) {
+			lprintf(LOG_NOTICE, "Disk %s is responding again\n", path);
+			job->hung = 0;
+		}
+		pthread_cond_signal(&m_statfs_done);
+	}
+
+	return NULL;
+}
+
+/* Wait for the workers on CLOCK_MONOTONIC, setting the time must not stall the collector */
+static void statfs_init(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&m_statfs_done, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+/* Workers must not take the signals meant for the main loop */
+static int statfs_start(statfs_job_t *job)
+{
+	pthread_attr_t attr;
+	sigset_t all, old;
+	int rc;
+
+	pthread_cond_init(&job->wake, NULL);
+
+	/* Small stacks, with --low-latency they are locked in memory */
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, STATFS_STACK);
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	rc = pthread_create(&job->thread, &attr, statfs_worker, job);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_attr_destroy(&attr);
+	if (rc) {
+		lprintf(LOG_ERR, "Failed starting statfs worker for %s: %s\n",
+			g_disk_list[job - m_statfs], strerror(rc));
+		return -1;
+	}
+
+	pthread_detach(job->thread);
+	job->started = 1;
+
+	return 0;
+}
+
+static void disk_set(diskinfo_t *diskinfo, size_t i, const struct statfs *fs)
+{
+	if (!fs) {
+		diskinfo->total[i]               = 0;
+		diskinfo->free[i]                = 0;
+		diskinfo->used[i]                = 0;
+		diskinfo->blocks_used_percent[i] = 0;
+		diskinfo->inodes_used_percent[i] = 0;
+		return;
+	}
+
+	diskinfo->total[i] = ((float)fs->f_blocks * fs->f_bsize) / 1024;
+	diskinfo->free[i]  = ((float)fs->f_bfree  * fs->f_bsize) / 1024;
+	diskinfo->used[i]  = ((float)(fs->f_blocks - fs->f_bfree) * fs->f_bsize) / 1024;
+	diskinfo->blocks_used_percent[i] =
+		((float)(fs->f_blocks - fs->f_bfree) * 100 + fs->f_blocks - 1) / fs->f_blocks;
+	if (fs->f_files <= 0)
+		diskinfo->inodes_used_percent[i] = 0;
+	else
+		diskinfo->inodes_used_percent[i] =
+			((float)(fs->f_files - fs->f_ffree) * 100 + fs->f_files - 1) / fs->f_files;
+}
+
 void get_diskinfo(diskinfo_t *diskinfo)
 {
-	size_t i;
+	static int did_init = 0;
+	struct timespec deadline;
 	struct statfs fs;
+	time_t now = monotonic_time();
+	size_t i;
+	int waiting;
 
+	if (did_init == 0) {
+		statfs_init();
+		did_init = 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_nsec += STATFS_WAIT_MS * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&m_statfs_lock);
 	for (i = 0; i < g_disk_list_length; i++) {
-		if (statfs(g_disk_list[i], &fs) == -1) {
-			diskinfo->total[i]               = 0;
-			diskinfo->free[i]                = 0;
-			diskinfo->used[i]                = 0;
-			diskinfo->blocks_used_percent[i] = 0;
-			diskinfo->inodes_used_percent[i] = 0;
+		statfs_job_t *job = &m_statfs[i];
+
+		if (!job->started && statfs_start(job)) {
+			/* No worker, fall back to calling statfs() here */
+			disk_set(diskinfo, i, statfs(g_disk_list[i], &fs) ? NULL : &fs);
 			continue;
 		}
 
-		diskinfo->total[i] = ((float)fs.f_blocks * fs.f_bsize) / 1024;
-		diskinfo->free[i]  = ((float)fs.f_bfree  * fs.f_bsize) / 1024;
-		diskinfo->used[i]  = ((float)(fs.f_blocks - fs.f_bfree) * fs.f_bsize) / 1024;
-		diskinfo->blocks_used_percent[i] =
-			((float)(fs.f_blocks - fs.f_bfree) * 100 + fs.f_blocks - 1) / fs.f_blocks;
-		if (fs.f_files <= 0)
-			diskinfo->inodes_used_percent[i] = 0;
+		if (!job->busy) {
+			job->pending = 1;
+			pthread_cond_signal(&job->wake);
+		} else if (!job->hung && now - job->since > STATFS_TIMEOUT) {
+			lprintf(LOG_WARNING, "Disk %s not responding, reporting cached values\n", g_disk_list[i]);
+			job->hung = 1;
+		}
+	}
+
+	/* Give the workers a moment, the results of those that miss it are used next time */
+	do {
+		waiting = 0;
+		for (i = 0; i < g_disk_list_length; i++) {
+			if (m_statfs[i].started && (m_statfs[i].pending || m_statfs[i].busy) && !m_statfs[i].hung)
+				waiting = 1;
+		}
+	} while (waiting && pthread_cond_timedwait(&m_statfs_done, &m_statfs_lock, &deadline) == 0);
+
+	for (i = 0; i < g_disk_list_length; i++) {
+		if (m_statfs[i].started)
+			disk_set(diskinfo, i, m_statfs[i].valid ? &m_statfs[i].fs : NULL);
+		snprintf(diskinfo->device[i], sizeof(diskinfo->device[i]), "%s", m_disk_device[i]);
+	}
+	pthread_mutex_unlock(&m_statfs_lock);
+}
+
+/* Undo the octal escapes of spaces and such in /proc/self/mountinfo */
+static void mounts_unescape(char *str)
+{
+	char *dst = str;
+
+	while (*str) {
+		if (str[0] == '\\' && isdigit(str[1]) && isdigit(str[2]) && isdigit(str[3])) {
+			*dst++ = (str[1] - '0') * 64 + (str[2] - '0') * 8 + (str[3] - '0');
+			str += 4;
+		} else {
+			*dst++ = *str++;
+		}
+	}
+	*dst = '\0';
+}
+
+/* Whether @path is on the mount point @dir, i.e. @dir is a leading path component */
+static size_t mounts_match(const char *path, const char *dir)
+{
+	size_t len = strlen(dir);
+
+	if (!strcmp(dir, "/"))
+		return 1;
+	if (strncmp(path, dir, len) || (path[len] != '/' && path[len] != '\0'))
+		return 0;
+
+	return len;
+}
+
+/*
+ * Look up the device of each disk, the source of the mount with the longest
+ * mount point the disk's path is on.  Returns 1 if any device changed.
+ */
+int mounts_update(void)
+{
+	char line[1024], dir[512], source[MAX_STRING_SIZE], best[MAX_NR_DISKS][MAX_STRING_SIZE];
+	size_t i, len, best_len[MAX_NR_DISKS] = { 0 };
+	int changed = 0;
+	char *sep;
+	FILE *fp;
+
+	fp = fopen("/proc/self/mountinfo", "r");
+	if (!fp) {
+		lprintf(LOG_WARNING, "Failed opening /proc/self/mountinfo: %m\n");
+		return -1;
+	}
+
+	memset(best, 0, sizeof(best));
+	while (fgets(line, sizeof(line), fp)) {
+		/* ID PARENT MAJ:MIN ROOT MOUNTPOINT OPTIONS [OPTIONAL...] - FSTYPE SOURCE SUPEROPTIONS */
+		if (sscanf(line, "%*u %*u %*s %*s %511s", dir) != 1)
+			continue;
+		sep = strstr(line, " - ");
+		if (!sep || sscanf(sep, " - %*s %63s", source) != 1)
+			continue;
+
+		mounts_unescape(dir);
+		mounts_unescape(source);
+		for (i = 0; i < g_disk_list_length; i++) {
+			len = mounts_match(g_disk_list[i], dir);
+			if (len && len >= best_len[i]) {
+				best_len[i] = len;
+				snprintf(best[i], sizeof(best[i]), "%s", source);
+			}
+		}
+	}
+	fclose(fp);
+
+	pthread_mutex_lock(&m_statfs_lock);
+	for (i = 0; i < g_disk_list_length; i++) {
+		if (strcmp(m_disk_device[i], best[i])) {
+			memcpy(m_disk_device[i], best[i], sizeof(m_disk_device[i]));
+			changed = 1;
+		}
+	}
+	pthread_mutex_unlock(&m_statfs_lock);
+
+	return changed;
+}
+
+/* Returns a file to wait for EPOLLPRI on, signalling a change in the mount table */
+int mounts_open(void)
+{
+	m_mounts_fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+	if (m_mounts_fd == -1) {
+		lprintf(LOG_WARNING, "Failed opening /proc/self/mountinfo: %m\n");
+		return -1;
+	}
+
+	mounts_update();
+
+	return m_mounts_fd;
+}
+
+/*
+ * Block devices that come or go after the MIB was built are noticed by
+ * get_diskioinfo(), and the main loop rebuilds the MIB, see diskio_changed().
+ * Until then a device that is gone keeps reporting its last values, zeros
+ * would look like a wrap of its counters to the pollers.
+ */
+#define DISKIO_UNSEEN                                   UINT64_MAX
+
+static int m_diskio_changed;
+static int m_diskio_reset;
+
+/* The block devices for the diskIOTable, taken when the MIB is built */
+void get_diskio_list(void)
+{
+	char name[64];
+	size_t i;
+	FILE *fp;
+
+	for (i = 0; i < g_diskio_list_length; i++)
+		free(g_diskio_list[i]);
+	g_diskio_list_length = 0;
+
+	m_diskio_changed = 0;
+	m_diskio_reset = 1;
+
+	fp = fopen("/proc/diskstats", "r");
+	if (!fp) {
+		lprintf(LOG_WARNING, "Failed opening /proc/diskstats: %m\n");
+		return;
+	}
+
+	while (fscanf(fp, "%*u %*u %63s %*[^\n]", name) == 1) {
+		if (g_diskio_list_length == MAX_NR_DISKIO) {
+			lprintf(LOG_WARNING, "Too many block devices, only the first %d are monitored\n", MAX_NR_DISKIO);
+			break;
+		}
+
+		g_diskio_list[g_diskio_list_length] = strdup(name);
+		if (g_diskio_list[g_diskio_list_length])
+			g_diskio_list_length++;
+	}
+
+	fclose(fp);
+}
+
+/*
+ * One pass over /proc/diskstats, with the device name as the key after the
+ * major and minor numbers.  Sectors are 512 bytes, regardless of the device,
+ * and the busy time is in ms.
+ */
+void get_diskioinfo(diskioinfo_t *diskioinfo)
+{
+	static parser_t parser = { .fd = -1, .key = 2, .wide = 1 };
+	static field_t fields[MAX_NR_DISKIO + 1];
+	static uint64_t stats[MAX_NR_DISKIO][10];
+	size_t i, seen = 0;
+
+	/* The devices were taken anew, forget the values of the old ones */
+	if (m_diskio_reset) {
+		memset(stats, 0, sizeof(stats));
+		m_diskio_reset = 0;
+	}
+
+	memset(fields, 0, sizeof(fields));
+	for (i = 0; i < g_diskio_list_length; i++) {
+		stats[i][1] = DISKIO_UNSEEN;
+		fields[i].prefix   = g_diskio_list[i];
+		fields[i].len      = 10;
+		fields[i].value[0] = &stats[i][0];	/* reads completed */
+		fields[i].value[1] = &stats[i][1];	/* reads merged, only to tell the device is there */
+		fields[i].value[2] = &stats[i][2];	/* sectors read */
+		fields[i].value[4] = &stats[i][4];	/* writes completed */
+		fields[i].value[6] = &stats[i][6];	/* sectors written */
+		fields[i].value[9] = &stats[i][9];	/* ms doing I/O */
+	}
+
+	if (parse_file(&parser, "/proc/diskstats", fields)) {
+		memset(diskioinfo, 0, sizeof(*diskioinfo));
+		return;
+	}
+
+	for (i = 0; i < g_diskio_list_length; i++) {
+		if (stats[i][1] != DISKIO_UNSEEN)
+			seen++;
+		diskioinfo->nread_x[i]    = stats[i][2] * 512;
+		diskioinfo->nwritten_x[i] = stats[i][6] * 512;
+		diskioinfo->nread[i]      = diskioinfo->nread_x[i];
+		diskioinfo->nwritten[i]   = diskioinfo->nwritten_x[i];
+		diskioinfo->reads[i]      = stats[i][0];
+		diskioinfo->writes[i]     = stats[i][4];
+		diskioinfo->busy_time[i]  = stats[i][9] * 1000;
+	}
+
+	/* Devices gone, or lines for new ones while there is still room */
+	if (seen < g_diskio_list_length ||
+	    (parser.lines > seen && g_diskio_list_length < MAX_NR_DISKIO))
+		m_diskio_changed = 1;
+}
+
+/* Returns 1, once, if the block devices changed and the MIB must be rebuilt */
+int diskio_changed(void)
+{
+	int changed = m_diskio_changed;
+
+	m_diskio_changed = 0;
+
+	return changed;
+}
+
+/*
+ * Link state from rtnetlink
+ *
+ * The links of the system are learned from an RTM_GETLINK dump at startup
+ * and kept up to date by RTNLGRP_LINK events, so get_netinfo() no longer
+ * polls every interface with ioctls.  ifLastChange is the sysUpTime of the
+ * last status change of the link.  With auto-discovery the interface list
+ * follows the links, in ifindex order, rather than the configured one.
+ */
+typedef struct link_s {
+	int           ifindex;
+	unsigned int  seen;		/* dump generation the link was last reported in */
+	unsigned int  status;
+	unsigned int  last_change;
+	char          name[IFNAMSIZ];
+	unsigned char mac[6];
+} link_t;
+
+static link_t      *m_links;
+static size_t       m_links_len;
+static size_t       m_links_size;
+static unsigned int m_links_gen;
+static int          m_netlink_fd = -1;
+
+static unsigned int link_status(unsigned int flags)
+{
+	if (flags & IFF_UP)
+		return (flags & IFF_RUNNING) ? 1 : 7;
+
+	return 2;
+}
+
+/* Links are kept sorted by ifindex, returns the position @ifindex has or should have */
+static size_t link_search(int ifindex)
+{
+	size_t lo = 0, hi = m_links_len;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (m_links[mid].ifindex < ifindex)
+			lo = mid + 1;
 		else
-			diskinfo->inodes_used_percent[i] =
-				((float)(fs.f_files - fs.f_ffree) * 100 + fs.f_files - 1) / fs.f_files;
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static link_t *link_find(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < m_links_len; i++) {
+		if (!strcmp(m_links[i].name, name))
+			return &m_links[i];
+	}
+
+	return NULL;
+}
+
+/* Whether the link is, or should be, in the interface list */
+static int link_watched(const char *name)
+{
+	size_t i;
+
+	if (g_interface_auto)
+		return 1;
+
+	for (i = 0; i < g_interface_list_length; i++) {
+		if (!strcmp(g_interface_list[i], name))
+			return 1;
+	}
+
+	return 0;
+}
+
+static link_t *link_add(int ifindex, size_t pos)
+{
+	if (m_links_len == m_links_size) {
+		size_t size = m_links_size ? 2 * m_links_size : 16;
+		link_t *links = realloc(m_links, size * sizeof(link_t));
+
+		if (!links) {
+			lprintf(LOG_ERR, "Failed allocating link table: %m\n");
+			return NULL;
+		}
+		m_links = links;
+		m_links_size = size;
+	}
+
+	memmove(&m_links[pos + 1], &m_links[pos], (m_links_len - pos) * sizeof(link_t));
+	m_links_len++;
+
+	memset(&m_links[pos], 0, sizeof(link_t));
+	m_links[pos].ifindex = ifindex;
+	m_links[pos].status = 4;
+
+	return &m_links[pos];
+}
+
+static void link_del(size_t pos)
+{
+	m_links_len--;
+	memmove(&m_links[pos], &m_links[pos + 1], (m_links_len - pos) * sizeof(link_t));
+}
+
+/* Returns 2 if the interface list is affected, 1 if only the state of a watched link, else 0 */
+static int link_newlink(struct nlmsghdr *nh)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(nh);
+	struct rtattr *rta = IFLA_RTA(ifi);
+	int len = IFLA_PAYLOAD(nh), changed = 0;
+	const char *name = NULL;
+	const unsigned char *mac = NULL;
+	unsigned int status;
+	size_t pos;
+	link_t *link;
+
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == IFLA_IFNAME)
+			name = RTA_DATA(rta);
+		else if (rta->rta_type == IFLA_ADDRESS && RTA_PAYLOAD(rta) >= 6)
+			mac = RTA_DATA(rta);
+	}
+	if (!name)
+		return 0;
+
+	pos = link_search(ifi->ifi_index);
+	if (pos < m_links_len && m_links[pos].ifindex == ifi->ifi_index) {
+		link = &m_links[pos];
+		if (strncmp(link->name, name, IFNAMSIZ)) {
+			if (link_watched(link->name) || link_watched(name))
+				changed = 2;
+		}
+	} else {
+		link = link_add(ifi->ifi_index, pos);
+		if (!link)
+			return 0;
+		if (link_watched(name))
+			changed = 2;
+	}
+
+	snprintf(link->name, sizeof(link->name), "%s", name);
+	link->seen = m_links_gen;
+	if (mac)
+		memcpy(link->mac, mac, sizeof(link->mac));
+
+	status = link_status(ifi->ifi_flags);
+	if (status != link->status) {
+		link->status = status;
+		link->last_change = get_process_uptime();
+		if (!changed && link_watched(name))
+			changed = 1;
+	}
+
+	return changed;
+}
+
+static int link_dellink(struct nlmsghdr *nh)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(nh);
+	size_t pos = link_search(ifi->ifi_index);
+	int changed;
+
+	if (pos >= m_links_len || m_links[pos].ifindex != ifi->ifi_index)
+		return 0;
+
+	changed = link_watched(m_links[pos].name) ? 2 : 0;
+	link_del(pos);
+
+	return changed;
+}
+
+/* A dump reports all links, the ones it did not are gone (events were lost) */
+static int link_prune(void)
+{
+	size_t pos = 0;
+	int changed = 0;
+
+	while (pos < m_links_len) {
+		if (m_links[pos].seen == m_links_gen) {
+			pos++;
+			continue;
+		}
+
+		if (link_watched(m_links[pos].name))
+			changed = 2;
+		link_del(pos);
+	}
+
+	return changed;
+}
+
+/* With auto-discovery the interface list is the links, up to MAX_NR_INTERFACES */
+static void link_sync(void)
+{
+	size_t i;
+
+	if (!g_interface_auto)
+		return;
+
+	for (i = 0; i < g_interface_list_length; i++)
+		free(g_interface_list[i]);
+	g_interface_list_length = 0;
+
+	for (i = 0; i < m_links_len; i++) {
+		if (g_interface_list_length == MAX_NR_INTERFACES) {
+			lprintf(LOG_WARNING, "Too many interfaces, only the first %d are monitored\n", MAX_NR_INTERFACES);
+			break;
+		}
+
+		g_interface_list[g_interface_list_length] = strdup(m_links[i].name);
+		if (g_interface_list[g_interface_list_length])
+			g_interface_list_length++;
+	}
+}
+
+static int netlink_dump(void)
+{
+	struct {
+		struct nlmsghdr  nh;
+		struct ifinfomsg ifi;
+	} req;
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len   = NLMSG_LENGTH(sizeof(req.ifi));
+	req.nh.nlmsg_type  = RTM_GETLINK;
+	req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nh.nlmsg_seq   = ++m_links_gen;
+	req.ifi.ifi_family = AF_UNSPEC;
+
+	if (send(m_netlink_fd, &req, req.nh.nlmsg_len, 0) == -1) {
+		lprintf(LOG_WARNING, "Failed requesting link dump: %m\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Handle pending rtnetlink messages, @flags 0 blocks until the dump is done */
+static int netlink_read(int flags)
+{
+	char buf[16384] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct nlmsghdr *nh;
+	ssize_t len;
+	int ret, changed = 0;
+
+	while (1) {
+		len = recv(m_netlink_fd, buf, sizeof(buf), flags);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == ENOBUFS) {
+				/* The socket overran, events were lost, resynchronize */
+				lprintf(LOG_WARNING, "Lost link events, requesting link dump\n");
+				if (netlink_dump())
+					return -1;
+				continue;
+			}
+
+			lprintf(LOG_ERR, "Failed reading link events: %m\n");
+			return -1;
+		}
+
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+			switch (nh->nlmsg_type) {
+			case RTM_NEWLINK:
+				ret = link_newlink(nh);
+				break;
+
+			case RTM_DELLINK:
+				ret = link_dellink(nh);
+				break;
+
+			case NLMSG_DONE:
+				ret = link_prune();
+				if (!flags)
+					return ret > changed ? ret : changed;
+				break;
+
+			case NLMSG_ERROR:
+				lprintf(LOG_WARNING, "Link dump failed\n");
+				if (!flags)
+					return -1;
+				ret = 0;
+				break;
+
+			default:
+				ret = 0;
+				break;
+			}
+
+			if (ret > changed)
+				changed = ret;
+		}
 	}
+
+	return changed;
+}
+
+/* Returns the socket to wait for link events on, or -1 on error */
+int netlink_open(void)
+{
+	struct sockaddr_nl sa;
+
+	m_netlink_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (m_netlink_fd == -1) {
+		lprintf(LOG_ERR, "Failed opening rtnetlink socket: %m\n");
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	sa.nl_groups = RTMGRP_LINK;
+	if (bind(m_netlink_fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+		lprintf(LOG_ERR, "Failed subscribing to link events: %m\n");
+		goto error;
+	}
+
+	if (netlink_dump() || netlink_read(0) == -1)
+		goto error;
+
+	if (fcntl(m_netlink_fd, F_SETFL, fcntl(m_netlink_fd, F_GETFL) | O_NONBLOCK) == -1) {
+		lprintf(LOG_ERR, "Failed setting rtnetlink socket non-blocking: %m\n");
+		goto error;
+	}
+
+	link_sync();
+
+	return m_netlink_fd;
+error:
+	close(m_netlink_fd);
+	m_netlink_fd = -1;
+	return -1;
+}
+
+/*
+ * Handle the link events that have arrived.  Returns 2 if the interface
+ * list, or the ifindex of one of its interfaces, changed and the MIB has
+ * to be rebuilt, 1 if only the state of an interface did, else 0.
+ */
+int netlink_recv(void)
+{
+	int changed = netlink_read(MSG_DONTWAIT);
+
+	if (changed == 2)
+		link_sync();
+
+	return changed;
 }
 
 void get_netinfo(netinfo_t *netinfo)
 {
-	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	static parser_t parser = PARSER_INIT;
+	int fd = m_netlink_fd == -1 ? socket(AF_INET, SOCK_DGRAM, 0) : -1;
 	size_t i;
 	struct ifreq ifreq;
 	field_t fields[MAX_NR_INTERFACES + 1];
@@ -162,6 +878,16 @@ void get_netinfo(netinfo_t *netinfo)
 		fields[i].value[10] = &netinfo->tx_errors[i];
 		fields[i].value[11] = &netinfo->tx_drops[i];
 
+		if (m_netlink_fd != -1) {
+			link_t *link = link_find(g_interface_list[i]);
+
+			netinfo->status[i] = link ? link->status : 4;
+			netinfo->last_change[i] = link ? link->last_change : 0;
+			if (link)
+				memcpy(&netinfo->mac_addr[i][0], link->mac, 6);
+			continue;
+		}
+
 		snprintf(ifreq.ifr_name, sizeof(ifreq.ifr_name), "%s", g_interface_list[i]);
 		if (fd == -1 || ioctl(fd, SIOCGIFFLAGS, &ifreq) == -1) {
 			netinfo->status[i] = 4;
@@ -180,7 +906,7 @@ void get_netinfo(netinfo_t *netinfo)
 	if (fd != -1)
 		close(fd);
 
-	if (parse_file("/proc/net/dev", fields))
+	if (parse_file(&parser, "/proc/net/dev", fields))
 		memset(netinfo, 0, sizeof(*netinfo));
 }
 
@@ -13,15 +13,20 @@
  * See COPYING for GPL licensing information.
  */
 
+#define _GNU_SOURCE		/* PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP */
+
 #include <sys/time.h>
+#include <net/if.h>		/* if_nametoindex(), if_nameindex() */
 #include <unistd.h>
 #include <syslog.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>		/* offsetof */
 #include <stdint.h>		/* intptr_t/uintptr_t */
 #include <errno.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "mini_snmpd.h"
 
@@ -29,11 +34,11 @@
  * Module variables
  *
  * To extend the MIB, add the definition of the SNMP table here. Note that the
- * variables use OIDs that have two subids more, which both are specified in the
- * mib_build_entry() and mib_build_entries() function calls. For example, the
+ * variables use OIDs that have two subids more, the column and the row, which
+ * are taken from the table's column list and row count. For example, the
  * system table uses the OID .1.3.6.1.2.1.1, the first system table variable,
- * system.sysDescr.0 (using OID .1.3.6.1.2.1.1.1.0) is appended to the MIB using
- * the function call mib_build_entry(&m_system_oid, 1, 0, ...).
+ * system.sysDescr.0 (using OID .1.3.6.1.2.1.1.1.0) is column 1 of the system
+ * group, which has no rows, so it gets instance 0.
  *
  * The first parameter is the array containing the list of subids (up to 14 here),
  * the next is the number of subids. The last parameter is the length that this
@@ -51,18 +56,367 @@ static const oid_t m_memory_oid         = { { 1, 3, 6, 1, 4, 1, 2021, 4,
 static const oid_t m_disk_oid           = { { 1, 3, 6, 1, 4, 1, 2021, 9, 1      }, 9, 11 };
 static const oid_t m_load_oid           = { { 1, 3, 6, 1, 4, 1, 2021, 10, 1     }, 9, 11 };
 static const oid_t m_cpu_oid            = { { 1, 3, 6, 1, 4, 1, 2021, 11        }, 8, 10 };
+#ifdef __linux__
+static const oid_t m_diskio_oid         = { { 1, 3, 6, 1, 4, 1, 2021, 13, 15, 1, 1 }, 11, 13 };
+#endif
+static const oid_t m_snmp_oid           = { { 1, 3, 6, 1, 2, 1, 11              }, 7, 8  };
+static const oid_t m_agent_oid          = { { 1, 3, 6, 1, 4, 1, 99999, 100      }, 8, 10 };
+static const oid_t m_changes_oid        = { { 1, 3, 6, 1, 4, 1, 99999, 101      }, 8, 10 };
 #ifdef CONFIG_ENABLE_DEMO
 static const oid_t m_demo_oid           = { { 1, 3, 6, 1, 4, 1, 99999           }, 7, 10 };
 #endif
 
-static const int m_load_avg_times[3] = { 1, 5, 15 };
+/*
+ * The MIB registry
+ *
+ * Each group of scalars or table is declared below as a list of columns and
+ * registered in m_tables[], in any order, mib_build() sorts the MIB.  Scalars
+ * get instance 0, table rows are numbered from 1 up to the table's row count,
+ * unless the table has an array with the instance of each row.
+ *
+ * Column values come from one of these sources:
+ *
+ * - MIB_CONST/MIB_STRING: the same fixed value for all rows
+ * - MIB_INDEX:            the row instance, for the table's index column
+ * - MIB_LIST:             a string from an array, e.g. g_interface_list
+ * - MIB_SIZE:             a size_t variable, e.g. g_interface_list_length
+ * - MIB_FIELD/MIB_FIELDS: an unsigned int in the data filled in by the
+ *                         table's collector, or one per row from an array
+ * - MIB_BYTES:            an octet string from an array of byte arrays
+ * - MIB_FORMAT:           a string formatted from the collector's data
+ * - MIB_GETTER:           called each time the value is sent to a client
+ *
+ * The first four are set when the MIB is built, the collector based values
+ * each time the timer of the table's refresh class fires.
+ */
+enum {
+	MIB_SRC_CONST,
+	MIB_SRC_INDEX,
+	MIB_SRC_LIST,
+	MIB_SRC_SIZE,
+	MIB_SRC_FIELD,
+	MIB_SRC_BYTES,
+	MIB_SRC_FORMAT,
+	MIB_SRC_GETTER
+};
+
+typedef struct mib_column_s {
+	int           column;
+	int           type;
+	int           source;
+	const void   *arg;
+	size_t        offset;
+	size_t        stride;
+
+	unsigned int (*get)(void);
+	const char  *(*format)(const void *data, size_t row, char *buf, size_t len);
+} mib_column_t;
+
+typedef struct mib_table_s {
+	const oid_t        *prefix;
+	const mib_column_t *columns;
+	size_t              num_columns;
+	const size_t       *rows;		/* NULL for a group of scalars */
+	const unsigned int *index;		/* instance of each row, NULL for 1..rows */
+	int                 class;		/* MIB_REFRESH_*, -1 if static */
+	void              (*collect)(void *data);
+	size_t              size;		/* of the collector's data */
+
+	/* Set up by mib_build() */
+	size_t              num_rows;
+	void               *data;
+	void               *prev;		/* data of the last update ... */
+	int                 prev_valid;		/* ... once there was one */
+	value_t           **bind;		/* [column][row] */
+} mib_table_t;
+
+#define MIB_CONST(col, t, val)        { .column = col, .type = t, .source = MIB_SRC_CONST, .arg = (const void *)(intptr_t)(val) }
+#define MIB_STRING(col, t, str)       { .column = col, .type = t, .source = MIB_SRC_CONST, .arg = str }
+#define MIB_INDEX(col)                { .column = col, .type = BER_TYPE_INTEGER, .source = MIB_SRC_INDEX }
+#define MIB_LIST(col, t, list)        { .column = col, .type = t, .source = MIB_SRC_LIST, .arg = list }
+#define MIB_SIZE(col, var)            { .column = col, .type = BER_TYPE_INTEGER, .source = MIB_SRC_SIZE, .arg = var }
+#define MIB_FIELD(col, t, st, m)      { .column = col, .type = t, .source = MIB_SRC_FIELD, .offset = offsetof(st, m) }
+#define MIB_FIELDS(col, t, st, m)     { .column = col, .type = t, .source = MIB_SRC_FIELD, .offset = offsetof(st, m), \
+					.stride = sizeof(((st *)0)->m[0]) }
+#define MIB_BYTES(col, st, m)         { .column = col, .type = BER_TYPE_OCTET_STRING, .source = MIB_SRC_BYTES,        \
+					.offset = offsetof(st, m), .stride = sizeof(((st *)0)->m[0]) }
+#define MIB_FORMAT(col, t, fn)        { .column = col, .type = t, .source = MIB_SRC_FORMAT, .format = fn }
+#define MIB_GETTER(col, t, fn)        { .column = col, .type = t, .source = MIB_SRC_GETTER, .get = fn }
+
+#define MIB_GROUP(prefix, columns)    { prefix, columns, NELEMS(columns), NULL, NULL, -1, NULL, 0, 0, NULL, NULL, 0, NULL }
+#define MIB_TABLE(prefix, columns, rows, class, collect, st) \
+	{ prefix, columns, NELEMS(columns), rows, NULL, class, collect, sizeof(st), 0, NULL, NULL, 0, NULL }
+#define MIB_INDEXED_TABLE(prefix, columns, rows, index, class, collect, st) \
+	{ prefix, columns, NELEMS(columns), rows, index, class, collect, sizeof(st), 0, NULL, NULL, 0, NULL }
+
+static char m_hostname[MAX_STRING_SIZE];
+
+/* Bumped each time values change, and for each rebuild */
+static unsigned int m_generation;
+
+/*
+ * Held for reading while a request is handled by a protocol worker, and for
+ * writing while the MIB is rebuilt or its values are updated.  Collectors
+ * run without it.  Uncontended without workers.  Writers go first, a busy
+ * set of workers must not hold up the event loop.
+ */
+#ifdef PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+static pthread_rwlock_t m_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+#else
+static pthread_rwlock_t m_lock = PTHREAD_RWLOCK_INITIALIZER;
+#endif
+
+/* ifIndex of each interface in g_interface_list, see if_index_build() */
+static unsigned int m_if_index[MAX_NR_INTERFACES];
+
+static const char *const m_load_names[] = { "Load-1", "Load-5", "Load-15" };
+static const char *const m_load_times[] = { "1", "5", "15" };
+static const size_t      m_load_rows    = NELEMS(m_load_names);
+
+static void collect_netinfo(void *data)      { get_netinfo(data);      }
+#ifdef __linux__
+static void collect_wirelessinfo(void *data) { get_wirelessinfo(data); }
+#endif
+static void collect_meminfo(void *data)      { get_meminfo(data);      }
+static void collect_diskinfo(void *data)     { get_diskinfo(data);     }
+static void collect_loadinfo(void *data)     { get_loadinfo(data);     }
+static void collect_cpuinfo(void *data)      { get_cpuinfo(data);      }
+#ifdef __linux__
+static void collect_diskioinfo(void *data)   { get_diskioinfo(data);   }
+#endif
+static void collect_agentinfo(void *data)    { get_agentinfo(data);    }
+static unsigned int get_generation(void)     { return m_generation;    }
+#ifdef CONFIG_ENABLE_DEMO
+static void collect_demoinfo(void *data)     { get_demoinfo(data);     }
+#endif
+
+static const char *format_disk_device(const void *data, size_t row, char *UNUSED(buf), size_t UNUSED(len))
+{
+	const diskinfo_t *diskinfo = data;
+
+	return diskinfo->device[row];
+}
+
+static const char *format_load(const void *data, size_t row, char *buf, size_t len)
+{
+	const loadinfo_t *loadinfo = data;
+
+	snprintf(buf, len, "%u.%02u", loadinfo->avg[row] / 100, loadinfo->avg[row] % 100);
+
+	return buf;
+}
+
+/* The system MIB: basic info about the host (SNMPv2-MIB.txt) */
+static const mib_column_t m_system_columns[] = {
+	MIB_LIST   (1, BER_TYPE_OCTET_STRING, &g_description),
+	MIB_LIST   (2, BER_TYPE_OID,          &g_vendor),
+	MIB_GETTER (3, BER_TYPE_TIME_TICKS,   get_process_uptime),
+	MIB_LIST   (4, BER_TYPE_OCTET_STRING, &g_contact),
+	MIB_STRING (5, BER_TYPE_OCTET_STRING, m_hostname),
+	MIB_LIST   (6, BER_TYPE_OCTET_STRING, &g_location),
+};
+
+/* The interface MIB: network interfaces (IF-MIB.txt) */
+static const mib_column_t m_if_1_columns[] = {
+	MIB_SIZE   (1, &g_interface_list_length),
+};
+
+static const mib_column_t m_if_2_columns[] = {
+	MIB_INDEX  ( 1),
+	MIB_LIST   ( 2, BER_TYPE_OCTET_STRING, g_interface_list),
+	MIB_CONST  ( 3, BER_TYPE_INTEGER,      6),	/* ethernetCsmacd(6) */
+	MIB_CONST  ( 4, BER_TYPE_INTEGER,      1500),
+	MIB_CONST  ( 5, BER_TYPE_GAUGE,        1000000000),
+	MIB_BYTES  ( 6, netinfo_t, mac_addr),
+	MIB_CONST  ( 7, BER_TYPE_INTEGER,      1),	/* up(1) */
+	MIB_FIELDS ( 8, BER_TYPE_INTEGER,      netinfo_t, status),
+	MIB_FIELDS ( 9, BER_TYPE_TIME_TICKS,   netinfo_t, last_change),
+	MIB_FIELDS (10, BER_TYPE_COUNTER,      netinfo_t, rx_bytes),
+	MIB_FIELDS (11, BER_TYPE_COUNTER,      netinfo_t, rx_packets),
+	MIB_FIELDS (13, BER_TYPE_COUNTER,      netinfo_t, rx_drops),
+	MIB_FIELDS (14, BER_TYPE_COUNTER,      netinfo_t, rx_errors),
+	MIB_FIELDS (16, BER_TYPE_COUNTER,      netinfo_t, tx_bytes),
+	MIB_FIELDS (17, BER_TYPE_COUNTER,      netinfo_t, tx_packets),
+	MIB_FIELDS (19, BER_TYPE_COUNTER,      netinfo_t, tx_drops),
+	MIB_FIELDS (20, BER_TYPE_COUNTER,      netinfo_t, tx_errors),
+};
+
+/* The host MIB: additional host info (HOST-RESOURCES-MIB.txt) */
+static const mib_column_t m_host_columns[] = {
+	MIB_GETTER (1, BER_TYPE_TIME_TICKS,   get_system_uptime),
+};
+
+#ifdef __linux__
+static const mib_column_t m_wireless_columns[] = {
+	MIB_INDEX  (1),
+	MIB_LIST   (3, BER_TYPE_OCTET_STRING, g_wireless_list),
+	MIB_FIELDS (7, BER_TYPE_INTEGER,      wirelessinfo_t, noise),
+	MIB_FIELDS (8, BER_TYPE_INTEGER,      wirelessinfo_t, signal),
+};
+#endif
+
+/* The memory MIB: total/free memory (UCD-SNMP-MIB.txt) */
+static const mib_column_t m_memory_columns[] = {
+	MIB_FIELD  ( 5, BER_TYPE_INTEGER,     meminfo_t, total),
+	MIB_FIELD  ( 6, BER_TYPE_INTEGER,     meminfo_t, free),
+	MIB_FIELD  (13, BER_TYPE_INTEGER,     meminfo_t, shared),
+	MIB_FIELD  (14, BER_TYPE_INTEGER,     meminfo_t, buffers),
+	MIB_FIELD  (15, BER_TYPE_INTEGER,     meminfo_t, cached),
+};
+
+/* The disk MIB: mounted partitions (UCD-SNMP-MIB.txt) */
+static const mib_column_t m_disk_columns[] = {
+	MIB_INDEX  ( 1),
+	MIB_LIST   ( 2, BER_TYPE_OCTET_STRING, g_disk_list),
+	MIB_FORMAT ( 3, BER_TYPE_OCTET_STRING, format_disk_device),
+	MIB_FIELDS ( 6, BER_TYPE_INTEGER,      diskinfo_t, total),
+	MIB_FIELDS ( 7, BER_TYPE_INTEGER,      diskinfo_t, free),
+	MIB_FIELDS ( 8, BER_TYPE_INTEGER,      diskinfo_t, used),
+	MIB_FIELDS ( 9, BER_TYPE_INTEGER,      diskinfo_t, blocks_used_percent),
+	MIB_FIELDS (10, BER_TYPE_INTEGER,      diskinfo_t, inodes_used_percent),
+};
+
+/* The load MIB: CPU load averages (UCD-SNMP-MIB.txt) */
+static const mib_column_t m_load_columns[] = {
+	MIB_INDEX  (1),
+	MIB_LIST   (2, BER_TYPE_OCTET_STRING, m_load_names),
+	MIB_FORMAT (3, BER_TYPE_OCTET_STRING, format_load),
+	MIB_LIST   (4, BER_TYPE_OCTET_STRING, m_load_times),
+	MIB_FIELDS (5, BER_TYPE_INTEGER,      loadinfo_t, avg),
+};
+
+/* The CPU MIB: CPU statistics (UCD-SNMP-MIB.txt) */
+static const mib_column_t m_cpu_columns[] = {
+	MIB_FIELD  (50, BER_TYPE_COUNTER,     cpuinfo_t, user),
+	MIB_FIELD  (51, BER_TYPE_COUNTER,     cpuinfo_t, nice),
+	MIB_FIELD  (52, BER_TYPE_COUNTER,     cpuinfo_t, system),
+	MIB_FIELD  (53, BER_TYPE_COUNTER,     cpuinfo_t, idle),
+	MIB_FIELD  (59, BER_TYPE_COUNTER,     cpuinfo_t, irqs),
+	MIB_FIELD  (60, BER_TYPE_COUNTER,     cpuinfo_t, cntxts),
+};
+
+#ifdef __linux__
+/* The disk I/O MIB: block device statistics (UCD-DISKIO-MIB.txt) */
+static const mib_column_t m_diskio_columns[] = {
+	MIB_INDEX  ( 1),
+	MIB_LIST   ( 2, BER_TYPE_OCTET_STRING, g_diskio_list),
+	MIB_FIELDS ( 3, BER_TYPE_COUNTER,      diskioinfo_t, nread),
+	MIB_FIELDS ( 4, BER_TYPE_COUNTER,      diskioinfo_t, nwritten),
+	MIB_FIELDS ( 5, BER_TYPE_COUNTER,      diskioinfo_t, reads),
+	MIB_FIELDS ( 6, BER_TYPE_COUNTER,      diskioinfo_t, writes),
+	MIB_FIELDS (12, BER_TYPE_COUNTER64,    diskioinfo_t, nread_x),
+	MIB_FIELDS (13, BER_TYPE_COUNTER64,    diskioinfo_t, nwritten_x),
+	MIB_FIELDS (14, BER_TYPE_COUNTER64,    diskioinfo_t, busy_time),
+};
+#endif
+
+/* The SNMP MIB: the agent's protocol counters (SNMPv2-MIB.txt) */
+static const mib_column_t m_snmp_columns[] = {
+	MIB_FIELD  ( 1, BER_TYPE_COUNTER,     agentinfo_t, in_pkts),
+	MIB_FIELD  ( 3, BER_TYPE_COUNTER,     agentinfo_t, in_bad_versions),
+	MIB_FIELD  ( 4, BER_TYPE_COUNTER,     agentinfo_t, in_bad_community_names),
+	MIB_FIELD  ( 5, BER_TYPE_COUNTER,     agentinfo_t, in_bad_community_uses),
+	MIB_FIELD  ( 6, BER_TYPE_COUNTER,     agentinfo_t, in_asn_parse_errs),
+	MIB_CONST  (30, BER_TYPE_INTEGER,     2),	/* snmpEnableAuthenTraps: disabled(2) */
+	MIB_FIELD  (31, BER_TYPE_COUNTER,     agentinfo_t, silent_drops),
+	MIB_CONST  (32, BER_TYPE_COUNTER,     0),	/* snmpProxyDrops */
+};
+
+/* The agent MIB: UDP buffers, drops, retransmissions, shedding and budgets, private */
+static const mib_column_t m_agent_columns[] = {
+	MIB_FIELD  ( 1, BER_TYPE_INTEGER,     agentinfo_t, udp_rcvbuf),
+	MIB_FIELD  ( 2, BER_TYPE_INTEGER,     agentinfo_t, udp_sndbuf),
+	MIB_FIELD  ( 3, BER_TYPE_COUNTER,     agentinfo_t, udp_drops),
+	MIB_FIELD  ( 4, BER_TYPE_GAUGE,       agentinfo_t, udp_queue),
+	MIB_FIELD  ( 5, BER_TYPE_GAUGE,       agentinfo_t, udp_queue_max),
+	MIB_FIELD  ( 6, BER_TYPE_COUNTER,     agentinfo_t, dup_resends),
+	MIB_FIELD  ( 7, BER_TYPE_COUNTER,     agentinfo_t, dup_drops),
+	MIB_FIELD  ( 8, BER_TYPE_COUNTER,     agentinfo_t, shed_bulk),
+	MIB_FIELD  ( 9, BER_TYPE_COUNTER,     agentinfo_t, shed_next),
+	MIB_FIELD  (10, BER_TYPE_COUNTER,     agentinfo_t, bulk_truncated),
+};
+
+/*
+ * The changes MIB, private: .1.0 is the current MIB generation, and .2 a
+ * virtual column, see mib_findnext(), whose entries .2.N.<OID> are the MIB
+ * entries that changed since generation N.
+ */
+static const mib_column_t m_changes_columns[] = {
+	MIB_GETTER ( 1, BER_TYPE_COUNTER,     get_generation),
+};
+
+#ifdef CONFIG_ENABLE_DEMO
+/* The demo MIB: two random integers */
+static const mib_column_t m_demo_columns[] = {
+	MIB_FIELD  (1, BER_TYPE_INTEGER,      demoinfo_t, random_value_1),
+	MIB_FIELD  (2, BER_TYPE_INTEGER,      demoinfo_t, random_value_2),
+};
+#endif
+
+static mib_table_t m_tables[] = {
+	MIB_GROUP (&m_system_oid,   m_system_columns),
+	MIB_GROUP (&m_if_1_oid,     m_if_1_columns),
+	MIB_INDEXED_TABLE (&m_if_2_oid, m_if_2_columns, &g_interface_list_length, m_if_index,
+			   MIB_REFRESH_NET, collect_netinfo, netinfo_t),
+	MIB_GROUP (&m_host_oid,     m_host_columns),
+#ifdef __linux__
+	MIB_TABLE (&m_wireless_oid, m_wireless_columns, &g_wireless_list_length,  MIB_REFRESH_WIRELESS, collect_wirelessinfo, wirelessinfo_t),
+#endif
+	MIB_TABLE (&m_memory_oid,   m_memory_columns,   NULL,                     MIB_REFRESH_MEM,      collect_meminfo,      meminfo_t),
+	MIB_TABLE (&m_disk_oid,     m_disk_columns,     &g_disk_list_length,      MIB_REFRESH_DISK,     collect_diskinfo,     diskinfo_t),
+	MIB_TABLE (&m_load_oid,     m_load_columns,     &m_load_rows,             MIB_REFRESH_LOAD,     collect_loadinfo,     loadinfo_t),
+	MIB_TABLE (&m_cpu_oid,      m_cpu_columns,      NULL,                     MIB_REFRESH_CPU,      collect_cpuinfo,      cpuinfo_t),
+#ifdef __linux__
+	MIB_TABLE (&m_diskio_oid,   m_diskio_columns,   &g_diskio_list_length,    MIB_REFRESH_DISKIO,   collect_diskioinfo,   diskioinfo_t),
+#endif
+	MIB_TABLE (&m_snmp_oid,     m_snmp_columns,     NULL,                     MIB_REFRESH_AGENT,    collect_agentinfo,    agentinfo_t),
+	MIB_TABLE (&m_agent_oid,    m_agent_columns,    NULL,                     MIB_REFRESH_AGENT,    collect_agentinfo,    agentinfo_t),
+	MIB_GROUP (&m_changes_oid,  m_changes_columns),
+#ifdef CONFIG_ENABLE_DEMO
+	MIB_TABLE (&m_demo_oid,     m_demo_columns,     NULL,                     MIB_REFRESH_DEMO,     collect_demoinfo,     demoinfo_t),
+#endif
+};
+
+/*
+ * The hot half of the MIB: one compact key per g_mib entry, in the same
+ * order, for the binary searches of mib_find() and mib_findnext().  The
+ * payload in g_mib is only touched for the entry that was found.
+ */
+typedef struct mib_key_s {
+	uint16_t table;			/* index in m_tables[] */
+	uint16_t column;
+	uint32_t row;
+} mib_key_t;
+
+static mib_key_t *m_keys;
+static size_t     m_mib_size;
+
+/*
+ * Open addressing hash index of the MIB for exact GET lookups, with linear
+ * probing.  Slots hold the OID hash and the g_mib index + 1, 0 when empty.
+ */
+typedef struct mib_slot_s {
+	uint32_t hash;
+	uint32_t index;
+} mib_slot_t;
+
+static mib_slot_t *m_hash;
+static size_t      m_hash_mask;
+
+/* Data buffers and encoded OIDs of all MIB entries, carved from one allocation */
+static unsigned char *m_arena;
+static size_t         m_arena_size;
+static size_t         m_arena_len;
 
 static int oid_build  (oid_t *oid, const oid_t *prefix, int column, int row);
 static int encode_oid_len (oid_t *oid);
 
-static int data_alloc (data_t *data, int type);
+static int data_alloc (data_t *data, int type, size_t len);
 static int data_set   (data_t *data, int type, const void *arg);
 
+static int mib_data_set       (const oid_t *oid, data_t *data, int type, const void *arg);
+static int mib_byte_array_set (const oid_t *oid, data_t *data, const void *arg, size_t len);
+
 
 static int encode_integer(data_t *data, int integer_value)
 {
@@ -96,11 +450,10 @@ static int encode_byte_array(data_t *data, const char *string, size_t len)
 	if (!string)
 		return 2;
 
+	/* The buffer was sized for the longest value when the MIB was built */
 	if ((len + 4) > data->max_length) {
-		data->max_length = len + 4;
-		data->buffer = realloc(data->buffer, data->max_length);
-		if (!data->buffer)
-			return 2;
+		lprintf(LOG_DEBUG, "Truncating OCTET STRING of %zu bytes to %zu\n", len, data->max_length - 4);
+		len = data->max_length - 4;
 	}
 
 	if (len > 0xFFFF) {
@@ -231,20 +584,58 @@ static int encode_unsigned(data_t *data, int type, unsigned int ticks_value)
 	return 0;
 }
 
-static value_t *mib_alloc_entry(const oid_t *prefix, int column, int row, int type)
+static int encode_counter64(data_t *data, uint64_t value)
+{
+	unsigned char *buffer;
+	int length = 1;
+
+	while (length < 8 && (value >> (8 * length)))
+		length++;
+
+	/* Prepend a zero-byte if the value could be decoded as negative */
+	if ((value >> (8 * (length - 1))) & 0x80)
+		length++;
+
+	buffer    = data->buffer;
+	*buffer++ = BER_TYPE_COUNTER64;
+	*buffer++ = length;
+	while (length--)
+		*buffer++ = length < 8 ? (value >> (8 * length)) & 0xFF : 0;
+
+	data->encoded_length = buffer - data->buffer;
+
+	return 0;
+}
+
+static void *arena_alloc(size_t len)
+{
+	void *ptr;
+
+	if (m_arena_len + len > m_arena_size)
+		return NULL;
+
+	ptr = m_arena + m_arena_len;
+	m_arena_len += len;
+
+	return ptr;
+}
+
+static value_t *mib_alloc_entry(const oid_t *prefix, int column, int row, int type, size_t len)
 {
 	int ret;
 	value_t *value;
+	data_t oid;
 	const char *msg = "Failed creating MIB entry";
 
 	/* Create a new entry in the MIB table */
-	if (g_mib_length >= MAX_NR_VALUES) {
+	if (g_mib_length >= m_mib_size) {
 		lprintf(LOG_ERR, "%s '%s.%d.%d': table overflow\n", msg, oid_ntoa(prefix), column, row);
 		return NULL;
 	}
 
 	value = &g_mib[g_mib_length++];
-	memcpy(&value->oid, prefix, sizeof(value->oid));
+	memset(value, 0, sizeof(*value));
+	value->gen = m_generation;
 
 	/* Create the OID from the prefix, the column and the row */
 	if (oid_build(&value->oid, prefix, column, row)) {
@@ -253,30 +644,27 @@ static value_t *mib_alloc_entry(const oid_t *prefix, int column, int row, int ty
 	}
 
 	ret  = encode_oid_len(&value->oid);
-	ret += data_alloc(&value->data, type);
+	ret += data_alloc(&value->data, type, len);
 	if (ret) {
 		lprintf(LOG_ERR, "%s '%s.%d.%d': unsupported type %d\n", msg,
 			oid_ntoa(&value->oid), column, row, type);
 		return NULL;
 	}
 
+	/* Encode the OID once, responses copy it from here */
+	oid.buffer = arena_alloc(value->oid.encoded_length);
+	oid.max_length = value->oid.encoded_length;
+	if (!oid.buffer || encode_oid(&oid, &value->oid)) {
+		lprintf(LOG_ERR, "%s '%s': arena overflow\n", msg, oid_ntoa(&value->oid));
+		return NULL;
+	}
+	value->encoded_oid = oid.buffer;
+
 	return value;
 }
 
-static int mib_data_set(const oid_t *oid, data_t *data, int column, int row, int type, const void *arg);
-
-static int mib_build_entry(const oid_t *prefix, int column, int row, int type, const void *arg)
-{
-	value_t *value;
-
-	value = mib_alloc_entry(prefix, column, row, type);
-	if (!value)
-		return -1;
-
-	return mib_data_set(&value->oid, &value->data, column, row, type, arg);
-}
 
-static int mib_data_set(const oid_t *oid, data_t *data, int column, int row, int type, const void *arg)
+static int mib_data_set(const oid_t *oid, data_t *data, int type, const void *arg)
 {
 	int ret;
 	const char *msg = "Failed assigning value to OID";
@@ -284,9 +672,9 @@ static int mib_data_set(const oid_t *oid, data_t *data, int column, int row, int
 	ret = data_set(data, type, arg);
 	if (ret) {
 		if (ret == 1)
-			lprintf(LOG_ERR, "%s '%s.%d.%d': unsupported type %d\n", msg, oid_ntoa(oid), column, row, type);
+			lprintf(LOG_ERR, "%s '%s': unsupported type %d\n", msg, oid_ntoa(oid), type);
 		else if (ret == 2)
-			lprintf(LOG_ERR, "%s '%s.%d.%d': invalid default value\n", msg, oid_ntoa(oid), column, row);
+			lprintf(LOG_ERR, "%s '%s': invalid default value\n", msg, oid_ntoa(oid));
 
 		return -1;
 	}
@@ -294,7 +682,7 @@ static int mib_data_set(const oid_t *oid, data_t *data, int column, int row, int
 	return 0;
 }
 
-static int mib_byte_array_set(const oid_t *oid, data_t *data, int column, int row, const void *arg, size_t len)
+static int mib_byte_array_set(const oid_t *oid, data_t *data, const void *arg, size_t len)
 {
 	int ret;
 	const char *msg = "Failed assigning value to OID";
@@ -302,7 +690,7 @@ static int mib_byte_array_set(const oid_t *oid, data_t *data, int column, int ro
 	ret = encode_byte_array(data, arg, len);
 	if (ret) {
 		if (ret == 2)
-			lprintf(LOG_ERR, "%s '%s.%d.%d': invalid default value\n", msg, oid_ntoa(oid), column, row);
+			lprintf(LOG_ERR, "%s '%s': invalid default value\n", msg, oid_ntoa(oid));
 		return -1;
 	}
 
@@ -333,17 +721,20 @@ static int oid_build(oid_t *oid, const oid_t *prefix, int column, int row)
  */
 static int encode_oid_len(oid_t *oid)
 {
+	unsigned int buffer[MAX_NR_OID_SUBIDS];
+	const unsigned int *subids;
 	uint32_t len = 1;
-	size_t i;
+	size_t i, num;
 
-	for (i = 2; i < oid->subid_list_length; i++) {
-		if (oid->subid_list[i] >= (1 << 28))
+	subids = mib_oid_subids(oid, buffer, &num);
+	for (i = 2; i < num; i++) {
+		if (subids[i] >= (1 << 28))
 			len += 5;
-		else if (oid->subid_list[i] >= (1 << 21))
+		else if (subids[i] >= (1 << 21))
 			len += 4;
-		else if (oid->subid_list[i] >= (1 << 14))
+		else if (subids[i] >= (1 << 14))
 			len += 3;
-		else if (oid->subid_list[i] >= (1 << 7))
+		else if (subids[i] >= (1 << 7))
 			len += 2;
 		else
 			len += 1;
@@ -367,44 +758,47 @@ static int encode_oid_len(oid_t *oid)
 	return 0;
 }
 
-/* Create a data buffer for the value depending on the type:
+/* Size of the data buffer for the value depending on the type:
  *
- * - strings and oids are assumed to be static or have the maximum allowed length
- * - integers are assumed to be dynamic and don't have more than 32 bits
+ * - strings are sized for @len characters, the longest value they can have
+ * - oids are sized for the maximum allowed length
+ * - integers don't have more than 32 bits, except for Counter64
  */
-static int data_alloc(data_t *data, int type)
+static size_t data_size(int type, size_t len)
 {
 	switch (type) {
 		case BER_TYPE_INTEGER:
-			data->max_length = sizeof(int) + 2;
-			data->encoded_length = 0;
-			data->buffer = allocate(data->max_length);
-			break;
+			return sizeof(int) + 2;
 
 		case BER_TYPE_OCTET_STRING:
-			data->max_length = 4;
-			data->encoded_length = 0;
-			data->buffer = allocate(data->max_length);
-			break;
+			return len + 4;
 
 		case BER_TYPE_OID:
-			data->max_length = MAX_NR_SUBIDS * 5 + 4;
-			data->encoded_length = 0;
-			data->buffer = allocate(data->max_length);
-			break;
+			return MAX_NR_SUBIDS * 5 + 4;
 
 		case BER_TYPE_COUNTER:
 		case BER_TYPE_GAUGE:
 		case BER_TYPE_TIME_TICKS:
-			data->max_length = sizeof(unsigned int) + 3;
-			data->encoded_length = 0;
-			data->buffer = allocate(data->max_length);
-			break;
+			return sizeof(unsigned int) + 3;
+
+		case BER_TYPE_COUNTER64:
+			return sizeof(uint64_t) + 3;
 
 		default:
-			return -1;
+			break;
 	}
 
+	return 0;
+}
+
+/* Create a data buffer for the value in the arena */
+static int data_alloc(data_t *data, int type, size_t len)
+{
+	data->max_length = data_size(type, len);
+	if (!data->max_length)
+		return -1;
+
+	data->buffer = arena_alloc(data->max_length);
 	if (!data->buffer)
 		return -1;
 
@@ -449,515 +843,733 @@ static int data_set(data_t *data, int type, const void *arg)
 	return 1;
 }
 
-static int mib_build_entries(const oid_t *prefix, int column, int row_from, int row_to, int type)
+
+/* Row subid of the given row of a table, scalars are instance 0 */
+static int table_row(const mib_table_t *table, size_t row)
+{
+	if (!table->rows)
+		return 0;
+
+	return table->index ? (int)table->index[row] : (int)row + 1;
+}
+
+/* Whether the column's value comes from the table's collector */
+static int column_refreshed(const mib_column_t *column)
+{
+	return column->source == MIB_SRC_FIELD ||
+	       column->source == MIB_SRC_BYTES ||
+	       column->source == MIB_SRC_FORMAT;
+}
+
+/* Set the initial value of a new entry, the collector based ones are set by mib_update() */
+static int column_init(value_t *value, const mib_column_t *column, size_t row)
+{
+	const void *arg;
+
+	switch (column->source) {
+	case MIB_SRC_CONST:
+		arg = column->arg;
+		break;
+
+	case MIB_SRC_INDEX:
+		arg = (const void *)(intptr_t)value->oid.subid_list[value->oid.subid_list_length - 1];
+		break;
+
+	case MIB_SRC_LIST:
+		arg = ((const char *const *)column->arg)[row];
+		break;
+
+	case MIB_SRC_SIZE:
+		arg = (const void *)(intptr_t)*(const size_t *)column->arg;
+		break;
+
+	case MIB_SRC_GETTER:
+		value->get = column->get;
+		return 0;
+
+	default:
+		return 0;
+	}
+
+	return mib_data_set(&value->oid, &value->data, column->type, arg);
+}
+
+/*
+ * Refresh an entry from the collector's @data, returns 1 if the value
+ * changed, 0 if not, and -1 on error.  Raw values are compared with the
+ * ones in @prev, the data of the last update, unless NULL, and are only
+ * encoded again when they differ.
+ */
+static int column_update(value_t *value, const mib_column_t *column, const void *data, const void *prev, size_t row)
 {
-	int row;
+	size_t len, offset = column->offset + row * column->stride;
+	const unsigned char *ptr = (const unsigned char *)data + offset;
+	unsigned char tmp[MAX_NR_SUBIDS * 5 + MAX_STRING_SIZE + 4];
+	data_t scratch = { tmp, 0, 0 };
+	char buf[MAX_STRING_SIZE];
+
+	switch (column->source) {
+	case MIB_SRC_FIELD:
+		len = column->type == BER_TYPE_COUNTER64 ? sizeof(uint64_t) : sizeof(unsigned int);
+		if (prev && !memcmp(ptr, (const unsigned char *)prev + offset, len))
+			return 0;
+
+		if (column->type == BER_TYPE_COUNTER64)
+			encode_counter64(&value->data, *(const uint64_t *)ptr);
+		else if (mib_data_set(&value->oid, &value->data, column->type,
+				      (const void *)(uintptr_t)*(const unsigned int *)ptr))
+			return -1;
+		return 1;
 
-	for (row = row_from; row <= row_to; row++) {
-		if (!mib_alloc_entry(prefix, column, row, type))
+	case MIB_SRC_BYTES:
+		if (prev && !memcmp(ptr, (const unsigned char *)prev + offset, column->stride))
+			return 0;
+
+		if (mib_byte_array_set(&value->oid, &value->data, ptr, column->stride))
+			return -1;
+		return 1;
+
+	case MIB_SRC_FORMAT:
+		/* May be formatted from anything in the data, so compare the encoding */
+		scratch.max_length = value->data.max_length;
+		if (!prev || scratch.max_length > sizeof(tmp))
+			scratch = value->data;
+
+		if (mib_data_set(&value->oid, &scratch, column->type, column->format(data, row, buf, sizeof(buf))))
 			return -1;
+		if (scratch.buffer == value->data.buffer)
+			return 1;
+		if (scratch.encoded_length == value->data.encoded_length &&
+		    !memcmp(scratch.buffer, value->data.buffer, scratch.encoded_length))
+			return 0;
+
+		memcpy(value->data.buffer, scratch.buffer, scratch.max_length);
+		value->data.encoded_length = scratch.encoded_length;
+		return 1;
+
+	default:
+		break;
 	}
 
 	return 0;
 }
 
-static value_t *mib_value_find(const oid_t *prefix, int column, int row, size_t *pos)
+/* The longest string the column can hold, for sizing its data buffers */
+static size_t column_strlen(const mib_column_t *column, size_t row)
 {
-	oid_t oid;
-	value_t *value;
-	const char *msg = "Failed updating OID";
+	const char *str;
 
-	memcpy(&oid, prefix, sizeof(oid));
+	if (column->type != BER_TYPE_OCTET_STRING)
+		return 0;
 
-	/* Create the OID from the prefix, the column and the row */
-	if (oid_build(&oid, prefix, column, row)) {
-		lprintf(LOG_ERR, "%s '%s.%d.%d': OID overflow\n", msg, oid_ntoa(prefix), column, row);
-		return NULL;
+	switch (column->source) {
+	case MIB_SRC_CONST:
+		str = column->arg;
+		break;
+
+	case MIB_SRC_LIST:
+		str = ((const char *const *)column->arg)[row];
+		break;
+
+	case MIB_SRC_BYTES:
+		return column->stride;
+
+	case MIB_SRC_FORMAT:
+		return MAX_STRING_SIZE;
+
+	default:
+		return 0;
 	}
 
-	/* Search the MIB for the given OID beginning at the given position */
-	value = mib_find(&oid, pos);
-	if (!value)
-		lprintf(LOG_ERR, "%s '%s.%d.%d': OID not found\n", msg, oid_ntoa(prefix), column, row);
+	return str ? strlen(str) : 0;
+}
 
-	return value;
+/* Arena space needed for the data buffers and encoded OIDs of a table */
+static size_t table_size(const mib_table_t *table)
+{
+	size_t col, row, size = 0;
+	oid_t oid;
+
+	for (col = 0; col < table->num_columns; col++) {
+		const mib_column_t *column = &table->columns[col];
+
+		for (row = 0; row < table->num_rows; row++) {
+			/* Errors are reported when the entry is created */
+			if (oid_build(&oid, table->prefix, column->column, table_row(table, row)) ||
+			    encode_oid_len(&oid))
+				continue;
+
+			size += oid.encoded_length + data_size(column->type, column_strlen(column, row));
+		}
+	}
+
+	return size;
 }
 
-static int mib_update_entry(const oid_t *prefix, int column, int row, size_t *pos, int type, const void *arg)
+/* Compare the OID of a MIB key with @oid, like oid_cmp() */
+static int key_cmp(const mib_key_t *key, const oid_t *oid)
 {
-	value_t *value;
+	const oid_t *prefix = m_tables[key->table].prefix;
+	unsigned int subid, index[2] = { key->column, key->row };
+	size_t i, len = prefix->subid_list_length;
 
-	value = mib_value_find(prefix, column, row, pos);
-	if (!value)
-		return -1;
+	for (i = 0; i < len + 2; i++) {
+		if (i >= oid->subid_list_length)
+			return 1;
 
-	return mib_data_set(prefix, &value->data, column, row, type, arg);
+		subid = i < len ? prefix->subid_list[i] : index[i - len];
+		if (subid != oid->subid_list[i])
+			return subid > oid->subid_list[i] ? 1 : -1;
+	}
+
+	return oid->subid_list_length > len + 2 ? -1 : 0;
 }
 
-static int mib_update_byte_array(const oid_t *prefix, int column, int row, size_t *pos, const void *arg, size_t len)
+/* Index of the first entry not less than @oid, or greater than it if @next */
+static size_t mib_search(const oid_t *oid, int next)
 {
-	value_t *value;
+	size_t lo = 0, hi = g_mib_length;
 
-	value = mib_value_find(prefix, column, row, pos);
-	if (!value)
-		return -1;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = key_cmp(&m_keys[mid], oid);
+
+		if (cmp < 0 || (next && cmp == 0))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-	return mib_byte_array_set(prefix, &value->data, column, row, arg, len);
+	return lo;
 }
 
-/* -----------------------------------------------------------------------------
- * Interface functions
- *
- * To extend the MIB, add the relevant mib_build_entry() calls (to add one MIB
- * variable) or mib_build_entries() calls (to add a column of a MIB table) in
- * the mib_build() function. Note that building the MIB must be done strictly in
- * ascending OID order or the SNMP getnext/getbulk functions will not work as
- * expected!
- *
- * To extend the MIB, add the relevant mib_update_entry() calls (to update one
- * MIB variable or one cell in a MIB table) in the mib_update() function. Note
- * that the MIB variables must be added in the correct order (i.e. ascending).
- * How to get the value for that variable is up to you, but bear in mind that
- * the mib_update() function is called between receiving the request from the
- * client and sending back the response; thus you should avoid time-consuming
- * actions!
- *
- * The variable types supported up to now are OCTET_STRING, INTEGER (32 bit
- * signed), COUNTER (32 bit unsigned), TIME_TICKS (32 bit unsigned, in 1/10s)
- * and OID.
- *
- * Note that the maximum number of MIB variables is restricted by the length of
- * the MIB array, (see mini_snmpd.h for the value of MAX_NR_VALUES).
- */
+static int entry_cmp(const void *a, const void *b)
+{
+	return oid_cmp(&g_mib[*(const size_t *)a].oid, &g_mib[*(const size_t *)b].oid);
+}
 
-int mib_build(void)
+/* FNV-1a over the subids */
+static uint32_t oid_hash(const oid_t *oid)
 {
-	char hostname[MAX_STRING_SIZE];
-	char name[16];
+	uint32_t hash = 2166136261u;
 	size_t i;
 
-	/* Determine some static values that are not known at compile-time */
-	if (gethostname(hostname, sizeof(hostname)) == -1)
-		hostname[0] = '\0';
-	else if (hostname[sizeof(hostname) - 1] != '\0')
-		hostname[sizeof(hostname) - 1] = '\0';
-
-	/*
-	 * The system MIB: basic info about the host (SNMPv2-MIB.txt)
-	 * Caution: on changes, adapt the corresponding mib_update() section too!
-	 */
-	if (mib_build_entry(&m_system_oid, 1, 0, BER_TYPE_OCTET_STRING, g_description) == -1 ||
-	    mib_build_entry(&m_system_oid, 2, 0, BER_TYPE_OID,          g_vendor)      == -1 ||
-	   !mib_alloc_entry(&m_system_oid, 3, 0, BER_TYPE_TIME_TICKS)                        ||
-	    mib_build_entry(&m_system_oid, 4, 0, BER_TYPE_OCTET_STRING, g_contact)     == -1 ||
-	    mib_build_entry(&m_system_oid, 5, 0, BER_TYPE_OCTET_STRING, hostname)      == -1 ||
-	    mib_build_entry(&m_system_oid, 6, 0, BER_TYPE_OCTET_STRING, g_location)    == -1)
-		return -1;
+	for (i = 0; i < oid->subid_list_length; i++) {
+		hash ^= oid->subid_list[i];
+		hash *= 16777619u;
+	}
 
-	/*
-	 * The interface MIB: network interfaces (IF-MIB.txt)
-	 * Caution: on changes, adapt the corresponding mib_update() section too!
-	 */
-	if (g_interface_list_length > 0) {
-		if (mib_build_entry(&m_if_1_oid, 1, 0, BER_TYPE_INTEGER, (const void *)(intptr_t)g_interface_list_length) == -1)
-			return -1;
+	return hash;
+}
 
-		/* ifIndex -- XXX: Should be system ifindex! */
-		for (i = 0; i < g_interface_list_length; i++) {
-			if (mib_build_entry(&m_if_2_oid, 1, i + 1, BER_TYPE_INTEGER, (const void *)(intptr_t)(i + 1)) == -1)
-				return -1;
-		}
+static int mib_hash_build(void)
+{
+	size_t i, j, size = 16;
 
-		/* ifDescription */
-		for (i = 0; i < g_interface_list_length; i++) {
-			if (mib_build_entry(&m_if_2_oid, 2, i + 1, BER_TYPE_OCTET_STRING, g_interface_list[i]) == -1)
-				return -1;
-		}
+	/* Keep the load factor at or below 50% */
+	while (size < 2 * g_mib_length)
+		size <<= 1;
 
-		/* ifType: ENUM, ethernetCsmacd(6) <-- recommended for all types of Ethernets */
-		for (i = 0; i < g_interface_list_length; i++) {
-			if (mib_build_entry(&m_if_2_oid, 3, i + 1, BER_TYPE_INTEGER, (const void *)(intptr_t)6) == -1)
-				return -1;
-		}
+	m_hash = allocate(size * sizeof(mib_slot_t));
+	if (!m_hash)
+		return -1;
 
-		/* ifMtu */
-		for (i = 0; i < g_interface_list_length; i++) {
-			if (mib_build_entry(&m_if_2_oid, 4, i + 1, BER_TYPE_INTEGER, (const void *)(intptr_t)1500) == -1)
-				return -1;
-		}
+	memset(m_hash, 0, size * sizeof(mib_slot_t));
+	m_hash_mask = size - 1;
 
-		/* ifSpeed (in bps) */
-		for (i = 0; i < g_interface_list_length; i++) {
-			if (mib_build_entry(&m_if_2_oid, 5, i + 1, BER_TYPE_GAUGE, (const void *)(intptr_t)1000000000) == -1)
-				return -1;
-		}
+	for (i = 0; i < g_mib_length; i++) {
+		uint32_t hash = oid_hash(&g_mib[i].oid);
 
-		/* ifPhysAddress */
-		for (i = 1; i <= g_interface_list_length; i++)
-			if (mib_build_entry(&m_if_2_oid, 6, i, BER_TYPE_OCTET_STRING, "") == -1)
-				return -1;
+		for (j = hash & m_hash_mask; m_hash[j].index; j = (j + 1) & m_hash_mask)
+			;
+		m_hash[j].hash = hash;
+		m_hash[j].index = i + 1;
+	}
 
-		/* ifAdminStatus: up(1), down(2), testing(3) */
-		for (i = 0; i < g_interface_list_length; i++) {
-			if (mib_build_entry(&m_if_2_oid, 7, i + 1, BER_TYPE_INTEGER, (const void *)(intptr_t)1) == -1)
-				return -1;
-		}
+	return 0;
+}
 
-		/* ifOperStatus: up(1), down(2), testing(3), unknown(4), dormant(5), notPresent(6), lowerLayerDown(7) */
-		for (i = 0; i < g_interface_list_length; i++) {
-			if (mib_build_entry(&m_if_2_oid, 8, i + 1, BER_TYPE_INTEGER, (const void *)(intptr_t)1) == -1)
-				return -1;
-		}
+/* Sort g_mib and m_keys, the getnext/getbulk functions rely on ascending order */
+static int mib_sort(void)
+{
+	size_t i, *order;
+	value_t *values;
+	mib_key_t *keys;
+
+	order  = allocate(g_mib_length * sizeof(size_t));
+	values = allocate(g_mib_length * sizeof(value_t));
+	keys   = allocate(g_mib_length * sizeof(mib_key_t));
+	if (!order || !values || !keys) {
+		free(order);
+		free(values);
+		free(keys);
+		return -1;
+	}
 
-		/* ifLastChange */
-		for (i = 0; i < g_interface_list_length; i++) {
-			if (mib_build_entry(&m_if_2_oid, 9, i + 1, BER_TYPE_TIME_TICKS, (const void *)(intptr_t)0) == -1)
-				return -1;
-		}
+	for (i = 0; i < g_mib_length; i++)
+		order[i] = i;
+	qsort(order, g_mib_length, sizeof(size_t), entry_cmp);
 
-		if (mib_build_entries(&m_if_2_oid, 10, 1, g_interface_list_length, BER_TYPE_COUNTER) == -1 ||
-		    mib_build_entries(&m_if_2_oid, 11, 1, g_interface_list_length, BER_TYPE_COUNTER) == -1 ||
-		    mib_build_entries(&m_if_2_oid, 13, 1, g_interface_list_length, BER_TYPE_COUNTER) == -1 ||
-		    mib_build_entries(&m_if_2_oid, 14, 1, g_interface_list_length, BER_TYPE_COUNTER) == -1 ||
-		    mib_build_entries(&m_if_2_oid, 16, 1, g_interface_list_length, BER_TYPE_COUNTER) == -1 ||
-		    mib_build_entries(&m_if_2_oid, 17, 1, g_interface_list_length, BER_TYPE_COUNTER) == -1 ||
-		    mib_build_entries(&m_if_2_oid, 19, 1, g_interface_list_length, BER_TYPE_COUNTER) == -1 ||
-		    mib_build_entries(&m_if_2_oid, 20, 1, g_interface_list_length, BER_TYPE_COUNTER) == -1)
-			return -1;
+	for (i = 0; i < g_mib_length; i++) {
+		values[i] = g_mib[order[i]];
+		keys[i] = m_keys[order[i]];
 	}
 
-	/*
-	 * The host MIB: additional host info (HOST-RESOURCES-MIB.txt)
-	 * Caution: on changes, adapt the corresponding mib_update() section too!
-	 */
-	if (!mib_alloc_entry(&m_host_oid, 1, 0, BER_TYPE_TIME_TICKS))
-		return -1;
+	free(order);
+	free(g_mib);
+	free(m_keys);
+	g_mib = values;
+	m_keys = keys;
 
-#ifdef __linux__
-	if (g_wireless_list_length > 0) {
-		for (i = 0; i < g_wireless_list_length; i++) {
-			if (mib_build_entry(&m_wireless_oid, 1, i + 1, BER_TYPE_INTEGER, (const void *)(i + 1)) == -1)
-				return -1;
-		}
-		for (i = 0; i < g_wireless_list_length; i++) {
-			if (mib_build_entry(&m_wireless_oid, 3, i + 1, BER_TYPE_OCTET_STRING, g_wireless_list[i]) == -1)
+	return 0;
+}
+
+/* Create all entries of a table, the MIB is sorted afterwards */
+static int table_build(mib_table_t *table, size_t index)
+{
+	size_t col, row;
+	value_t *value;
+
+	for (col = 0; col < table->num_columns; col++) {
+		const mib_column_t *column = &table->columns[col];
+
+		for (row = 0; row < table->num_rows; row++) {
+			value = mib_alloc_entry(table->prefix, column->column, table_row(table, row), column->type,
+						column_strlen(column, row));
+			if (!value || column_init(value, column, row))
 				return -1;
+
+			m_keys[value - g_mib].table = index;
+			m_keys[value - g_mib].column = column->column;
+			m_keys[value - g_mib].row = table_row(table, row);
 		}
-		if (mib_build_entries(&m_wireless_oid, 7, 1, g_wireless_list_length, BER_TYPE_INTEGER) == -1 ||
-		    mib_build_entries(&m_wireless_oid, 8, 1, g_wireless_list_length, BER_TYPE_INTEGER) == -1)
-			return -1;
 	}
-#endif
 
-	/*
-	 * The memory MIB: total/free memory (UCD-SNMP-MIB.txt)
-	 * Caution: on changes, adapt the corresponding mib_update() section too!
-	 */
-	if (!mib_alloc_entry(&m_memory_oid,  5, 0, BER_TYPE_INTEGER) ||
-	    !mib_alloc_entry(&m_memory_oid,  6, 0, BER_TYPE_INTEGER) ||
-	    !mib_alloc_entry(&m_memory_oid, 13, 0, BER_TYPE_INTEGER) ||
-	    !mib_alloc_entry(&m_memory_oid, 14, 0, BER_TYPE_INTEGER) ||
-	    !mib_alloc_entry(&m_memory_oid, 15, 0, BER_TYPE_INTEGER))
+	return 0;
+}
+
+/* Look up the entries the collector refreshes, for mib_update() to write directly */
+static int table_bind(mib_table_t *table)
+{
+	size_t col, row, pos;
+	oid_t oid;
+
+	if (table->class < 0 || table->num_rows == 0)
+		return 0;
+
+	table->data = allocate(table->size);
+	table->prev = allocate(table->size);
+	table->bind = allocate(table->num_columns * table->num_rows * sizeof(value_t *));
+	if (!table->data || !table->prev || !table->bind)
 		return -1;
 
-	/*
-	 * The disk MIB: mounted partitions (UCD-SNMP-MIB.txt)
-	 * Caution: on changes, adapt the corresponding mib_update() section too!
-	 */
-	if (g_disk_list_length > 0) {
-		for (i = 0; i < g_disk_list_length; i++) {
-			if (mib_build_entry(&m_disk_oid, 1, i + 1, BER_TYPE_INTEGER, (const void *)(intptr_t)(i + 1)) == -1)
-				return -1;
-		}
+	memset(table->data, 0, table->size);
+	table->prev_valid = 0;
+	for (col = 0; col < table->num_columns; col++) {
+		const mib_column_t *column = &table->columns[col];
+		value_t **bind = &table->bind[col * table->num_rows];
+
+		for (row = 0; row < table->num_rows; row++) {
+			bind[row] = NULL;
+			if (!column_refreshed(column))
+				continue;
 
-		for (i = 0; i < g_disk_list_length; i++) {
-			if (mib_build_entry(&m_disk_oid, 2, i + 1, BER_TYPE_OCTET_STRING, g_disk_list[i]) == -1)
+			oid_build(&oid, table->prefix, column->column, table_row(table, row));
+			pos = mib_search(&oid, 0);
+			if (pos >= g_mib_length || key_cmp(&m_keys[pos], &oid))
 				return -1;
+
+			bind[row] = &g_mib[pos];
 		}
+	}
 
-		if (mib_build_entries(&m_disk_oid,  6, 1, g_disk_list_length, BER_TYPE_INTEGER) == -1 ||
-		    mib_build_entries(&m_disk_oid,  7, 1, g_disk_list_length, BER_TYPE_INTEGER) == -1 ||
-		    mib_build_entries(&m_disk_oid,  8, 1, g_disk_list_length, BER_TYPE_INTEGER) == -1 ||
-		    mib_build_entries(&m_disk_oid,  9, 1, g_disk_list_length, BER_TYPE_INTEGER) == -1 ||
-		    mib_build_entries(&m_disk_oid, 10, 1, g_disk_list_length, BER_TYPE_INTEGER) == -1)
-			return -1;
+	return 0;
+}
+
+/*
+ * The system ifindex of each interface, as the IF-MIB requires.  Interfaces
+ * that do not exist (yet) are numbered after the highest one, the MIB is
+ * rebuilt when they appear.
+ */
+static void if_index_build(void)
+{
+	struct if_nameindex *ifs, *ifp;
+	unsigned int max = 0;
+	size_t i;
+
+	ifs = if_nameindex();
+	for (ifp = ifs; ifp && ifp->if_index; ifp++) {
+		if (ifp->if_index > max)
+			max = ifp->if_index;
 	}
+	if (ifs)
+		if_freenameindex(ifs);
 
-	/*
-	 * The load MIB: CPU load averages (UCD-SNMP-MIB.txt)
-	 * Caution: on changes, adapt the corresponding mib_update() section too!
-	 */
-	for (i = 0; i < 3; i++) {
-		if (mib_build_entry(&m_load_oid, 1, i + 1, BER_TYPE_INTEGER, (const void *)(intptr_t)(i + 1)) == -1)
-			return -1;
+	for (i = 0; i < g_interface_list_length; i++)
+		m_if_index[i] = if_nametoindex(g_interface_list[i]);
+
+	for (i = 0; i < g_interface_list_length; i++) {
+		if (!m_if_index[i])
+			m_if_index[i] = ++max;
 	}
+}
 
-	for (i = 0; i < 3; i++) {
-		snprintf(name, sizeof(name), "Load-%d", m_load_avg_times[i]);
-		if (mib_build_entry(&m_load_oid, 2, i + 1, BER_TYPE_OCTET_STRING, name) == -1)
-			return -1;
+/* Release the MIB of a previous mib_build() */
+static void mib_free(void)
+{
+	size_t i;
+
+	for (i = 0; i < NELEMS(m_tables); i++) {
+		free(m_tables[i].data);
+		free(m_tables[i].prev);
+		free(m_tables[i].bind);
+		m_tables[i].data = NULL;
+		m_tables[i].prev = NULL;
+		m_tables[i].bind = NULL;
 	}
 
-	if (mib_build_entries(&m_load_oid, 3, 1, 3, BER_TYPE_OCTET_STRING) == -1)
+	free(g_mib);
+	free(m_keys);
+	free(m_arena);
+	free(m_hash);
+	g_mib = NULL;
+	m_keys = NULL;
+	m_arena = NULL;
+	m_hash = NULL;
+	g_mib_length = 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * Interface functions
+ *
+ * To extend the MIB, add the OID prefix and a list of columns for the group of
+ * scalars or the table above, and register it in m_tables[]. Tables with values
+ * that change also need a collector, a function filling in a struct with the
+ * current values, and a refresh class (see mini_snmpd.h) that decides when the
+ * collector is called. How to get the values is up to you, each refresh class
+ * is updated by its own timer, in between handling requests, so avoid
+ * time-consuming actions!
+ *
+ * The variable types supported up to now are OCTET_STRING, INTEGER (32 bit
+ * signed), COUNTER (32 bit unsigned), TIME_TICKS (32 bit unsigned, in 1/10s)
+ * and OID, and COUNTER64 for MIB_FIELDS of uint64_t.
+ *
+ * Variables that change on every read, like the uptimes, are declared with
+ * MIB_GETTER, the getter is called when encoding a response.
+ */
+
+/* May be called again to rebuild the MIB, e.g. when the interfaces change */
+static int mib_rebuild(void)
+{
+	size_t i, count = 0, size = 0;
+
+	mib_free();
+	m_generation++;
+	if_index_build();
+#ifdef __linux__
+	get_diskio_list();
+#endif
+
+	/* Determine some static values that are not known at compile-time */
+	if (gethostname(m_hostname, sizeof(m_hostname)) == -1)
+		m_hostname[0] = '\0';
+	else if (m_hostname[sizeof(m_hostname) - 1] != '\0')
+		m_hostname[sizeof(m_hostname) - 1] = '\0';
+
+	for (i = 0; i < NELEMS(m_tables); i++) {
+		mib_table_t *table = &m_tables[i];
+
+		table->num_rows = table->rows ? *table->rows : 1;
+		count += table->num_columns * table->num_rows;
+		size += table_size(table);
+	}
+
+	g_mib = allocate(count * sizeof(value_t));
+	m_keys = allocate(count * sizeof(mib_key_t));
+	m_arena = allocate(size);
+	if (!g_mib || !m_keys || !m_arena)
 		return -1;
 
-	for (i = 0; i < 3; i++) {
-		snprintf(name, sizeof(name), "%d", m_load_avg_times[i]);
-		if (mib_build_entry(&m_load_oid, 4, i + 1, BER_TYPE_OCTET_STRING, name) == -1)
+	g_mib_length = 0;
+	m_mib_size = count;
+	m_arena_len = 0;
+	m_arena_size = size;
+
+	for (i = 0; i < NELEMS(m_tables); i++) {
+		if (table_build(&m_tables[i], i))
 			return -1;
 	}
 
-	if (mib_build_entries(&m_load_oid, 5, 1, 3, BER_TYPE_INTEGER) == -1)
+	if (mib_sort())
 		return -1;
 
-	/* The CPU MIB: CPU statistics (UCD-SNMP-MIB.txt)
-	 * Caution: on changes, adapt the corresponding mib_update() section too!
-	 */
-	if (!mib_alloc_entry(&m_cpu_oid, 50, 0, BER_TYPE_COUNTER) ||
-	    !mib_alloc_entry(&m_cpu_oid, 51, 0, BER_TYPE_COUNTER) ||
-	    !mib_alloc_entry(&m_cpu_oid, 52, 0, BER_TYPE_COUNTER) ||
-	    !mib_alloc_entry(&m_cpu_oid, 53, 0, BER_TYPE_COUNTER) ||
-	    !mib_alloc_entry(&m_cpu_oid, 59, 0, BER_TYPE_COUNTER) ||
-	    !mib_alloc_entry(&m_cpu_oid, 60, 0, BER_TYPE_COUNTER))
-		return -1;
+	for (i = 1; i < g_mib_length; i++) {
+		if (!oid_cmp(&g_mib[i - 1].oid, &g_mib[i].oid)) {
+			lprintf(LOG_ERR, "Failed building MIB: duplicate OID '%s'\n", oid_ntoa(&g_mib[i].oid));
+			return -1;
+		}
+	}
 
-	/* The demo MIB: two random integers
-	 * Caution: on changes, adapt the corresponding mib_update() section too!
-	 */
-#ifdef CONFIG_ENABLE_DEMO
-	if (!mib_alloc_entry(&m_demo_oid, 1, 0, BER_TYPE_INTEGER) ||
-	    !mib_alloc_entry(&m_demo_oid, 2, 0, BER_TYPE_INTEGER))
+	if (mib_hash_build())
 		return -1;
-#endif
+
+	for (i = 0; i < NELEMS(m_tables); i++) {
+		if (table_bind(&m_tables[i])) {
+			lprintf(LOG_ERR, "Failed binding MIB table '%s'\n", oid_ntoa(m_tables[i].prefix));
+			return -1;
+		}
+	}
 
 	return 0;
 }
 
-int mib_update(int full)
+int mib_build(void)
 {
-	char nr[16];
-	size_t i, pos;
-	union {
-		diskinfo_t diskinfo;
-		loadinfo_t loadinfo;
-		meminfo_t meminfo;
-		cpuinfo_t cpuinfo;
-		netinfo_t netinfo;
-#ifdef __linux__
-		wirelessinfo_t wirelessinfo;
-#endif
-#ifdef CONFIG_ENABLE_DEMO
-		demoinfo_t demoinfo;
-#endif
-	} u;
+	int rc;
 
-	/* Begin searching at the first MIB entry */
-	pos = 0;
+	pthread_rwlock_wrlock(&m_lock);
+	rc = mib_rebuild();
+	pthread_rwlock_unlock(&m_lock);
 
-	/*
-	 * The system MIB: basic info about the host (SNMPv2-MIB.txt)
-	 * Caution: on changes, adapt the corresponding mib_build() section too!
-	 */
-	if (mib_update_entry(&m_system_oid, 3, 0, &pos, BER_TYPE_TIME_TICKS, (const void *)(uintptr_t)get_process_uptime()) == -1)
-		return -1;
+	return rc;
+}
 
-	/*
-	 * The interface MIB: network interfaces (IF-MIB.txt)
-	 * Caution: on changes, adapt the corresponding mib_build() section too!
-	 */
-	if (full) {
-		if (g_interface_list_length > 0) {
-			get_netinfo(&u.netinfo);
-
-			for (i = 0; i < g_interface_list_length; i++)
-				if (mib_update_byte_array(&m_if_2_oid, 6, i + 1, &pos, &u.netinfo.mac_addr[i][0], sizeof(u.netinfo.mac_addr[i])))
-					return -1;
-
-			for (i = 0; i < g_interface_list_length; i++) {
-				if (mib_update_entry(&m_if_2_oid, 8, i + 1, &pos, BER_TYPE_INTEGER, (const void *)(intptr_t)u.netinfo.status[i]) == -1)
-					return -1;
-			}
+/* Returns the number of entries that changed, stamped with @gen, or -1 on error */
+static int table_update(mib_table_t *table, unsigned int gen)
+{
+	const void *prev = table->prev_valid ? table->prev : NULL;
+	size_t col, row;
+	int rc, changed = 0;
 
-			for (i = 0; i < g_interface_list_length; i++) {
-				if (mib_update_entry(&m_if_2_oid, 10, i + 1, &pos, BER_TYPE_COUNTER, (const void *)(uintptr_t)u.netinfo.rx_bytes[i]) == -1)
-					return -1;
-			}
+	for (col = 0; col < table->num_columns; col++) {
+		const mib_column_t *column = &table->columns[col];
+		value_t **bind = &table->bind[col * table->num_rows];
 
-			for (i = 0; i < g_interface_list_length; i++) {
-				if (mib_update_entry(&m_if_2_oid, 11, i + 1, &pos, BER_TYPE_COUNTER, (const void *)(uintptr_t)u.netinfo.rx_packets[i]) == -1)
-					return -1;
-			}
+		if (!column_refreshed(column))
+			continue;
 
-			for (i = 0; i < g_interface_list_length; i++) {
-				if (mib_update_entry(&m_if_2_oid, 13, i + 1, &pos, BER_TYPE_COUNTER, (const void *)(uintptr_t)u.netinfo.rx_drops[i]) == -1)
-					return -1;
+		for (row = 0; row < table->num_rows; row++) {
+			rc = column_update(bind[row], column, table->data, prev, row);
+			if (rc == -1)
+				return -1;
+			if (rc) {
+				bind[row]->gen = gen;
+				changed++;
 			}
+		}
+	}
 
-			for (i = 0; i < g_interface_list_length; i++) {
-				if (mib_update_entry(&m_if_2_oid, 14, i + 1, &pos, BER_TYPE_COUNTER, (const void *)(uintptr_t)u.netinfo.rx_errors[i]) == -1)
-					return -1;
-			}
+	memcpy(table->prev, table->data, table->size);
+	table->prev_valid = 1;
 
-			for (i = 0; i < g_interface_list_length; i++) {
-				if (mib_update_entry(&m_if_2_oid, 16, i + 1, &pos, BER_TYPE_COUNTER, (const void *)(uintptr_t)u.netinfo.tx_bytes[i]) == -1)
-					return -1;
-			}
+	return changed;
+}
 
-			for (i = 0; i < g_interface_list_length; i++) {
-				if (mib_update_entry(&m_if_2_oid, 17, i + 1, &pos, BER_TYPE_COUNTER, (const void *)(uintptr_t)u.netinfo.tx_packets[i]) == -1)
-					return -1;
-			}
+/*
+ * Refresh the tables of @class.  The MIB generation is bumped when any
+ * value changed, and the entries that did are stamped with it, the others
+ * keep their encoding and generation.
+ */
+int mib_update(int class)
+{
+	unsigned int gen = m_generation + 1;
+	size_t i;
+	int rc;
 
-			for (i = 0; i < g_interface_list_length; i++) {
-				if (mib_update_entry(&m_if_2_oid, 19, i + 1, &pos, BER_TYPE_COUNTER, (const void *)(uintptr_t)u.netinfo.tx_drops[i]) == -1)
-					return -1;
-			}
+	for (i = 0; i < NELEMS(m_tables); i++) {
+		mib_table_t *table = &m_tables[i];
 
-			for (i = 0; i < g_interface_list_length; i++) {
-				if (mib_update_entry(&m_if_2_oid, 20, i + 1, &pos, BER_TYPE_COUNTER, (const void *)(uintptr_t)u.netinfo.tx_errors[i]) == -1)
-					return -1;
-			}
-		}
+		if (table->class != class || table->num_rows == 0)
+			continue;
+
+		table->collect(table->data);
+
+		pthread_rwlock_wrlock(&m_lock);
+		rc = table_update(table, gen);
+		if (rc > 0)
+			m_generation = gen;
+		pthread_rwlock_unlock(&m_lock);
+		if (rc == -1)
+			return -1;
 	}
 
-	/*
-	 * The host MIB: additional host info (HOST-RESOURCES-MIB.txt)
-	 * Caution: on changes, adapt the corresponding mib_build() section too!
-	 */
-	if (mib_update_entry(&m_host_oid, 1, 0, &pos, BER_TYPE_TIME_TICKS, (const void *)(uintptr_t)get_system_uptime()) == -1)
+	return 0;
+}
+
+/* Keep the MIB from changing while a worker handles a request */
+void mib_lock(void)
+{
+	pthread_rwlock_rdlock(&m_lock);
+}
+
+void mib_unlock(void)
+{
+	pthread_rwlock_unlock(&m_lock);
+}
+
+/*
+ * The encoded value of a MIB entry, for dynamic entries this calls the getter
+ * and encodes into @scratch, which must hold at least MAX_DYNAMIC_SIZE bytes.
+ */
+const data_t *mib_value_data(const value_t *value, data_t *scratch)
+{
+	if (!value->get)
+		return &value->data;
+
+	if (data_set(scratch, value->data.buffer[0], (const void *)(uintptr_t)value->get()))
+		return NULL;
+
+	return scratch;
+}
+
+/* The refresh class of a MIB entry, -1 if it is not refreshed */
+int mib_class(const value_t *value)
+{
+	if (value < g_mib || value >= g_mib + g_mib_length)
 		return -1;
 
-#ifdef __linux__
-	if (full) {
-		if (g_wireless_list_length > 0) {
-			get_wirelessinfo(&u.wirelessinfo);
+	return m_tables[m_keys[value - g_mib].table].class;
+}
 
-			for (i = 0; i < g_wireless_list_length; i++) {
-				if (mib_update_entry(&m_wireless_oid, 7, i + 1, &pos, BER_TYPE_INTEGER, (const void *)(uintptr_t)u.wirelessinfo.noise[i]) == -1)
-					return -1;
-			}
+/* Find the OID in the MIB that is exactly the given one */
+value_t *mib_get(const oid_t *oid)
+{
+	uint32_t hash = oid_hash(oid);
+	size_t i, len = oid->subid_list_length * sizeof(oid->subid_list[0]);
 
-			for (i = 0; i < g_wireless_list_length; i++) {
-				if (mib_update_entry(&m_wireless_oid, 8, i + 1, &pos, BER_TYPE_INTEGER, (const void *)(uintptr_t)u.wirelessinfo.signal[i]) == -1)
-					return -1;
-			}
-		}
-	}
-#endif
+	for (i = hash & m_hash_mask; m_hash[i].index; i = (i + 1) & m_hash_mask) {
+		value_t *curr = &g_mib[m_hash[i].index - 1];
 
-	/*
-	 * The memory MIB: total/free memory (UCD-SNMP-MIB.txt)
-	 * Caution: on changes, adapt the corresponding mib_build() section too!
-	 */
-	if (full) {
-		get_meminfo(&u.meminfo);
-		if (mib_update_entry(&m_memory_oid,  5, 0, &pos, BER_TYPE_INTEGER, (const void *)(intptr_t)u.meminfo.total)   == -1 ||
-		    mib_update_entry(&m_memory_oid,  6, 0, &pos, BER_TYPE_INTEGER, (const void *)(intptr_t)u.meminfo.free)    == -1 ||
-		    mib_update_entry(&m_memory_oid, 13, 0, &pos, BER_TYPE_INTEGER, (const void *)(intptr_t)u.meminfo.shared)  == -1 ||
-		    mib_update_entry(&m_memory_oid, 14, 0, &pos, BER_TYPE_INTEGER, (const void *)(intptr_t)u.meminfo.buffers) == -1 ||
-		    mib_update_entry(&m_memory_oid, 15, 0, &pos, BER_TYPE_INTEGER, (const void *)(intptr_t)u.meminfo.cached)  == -1)
-			return -1;
+		if (m_hash[i].hash == hash &&
+		    curr->oid.subid_list_length == oid->subid_list_length &&
+		    !memcmp(curr->oid.subid_list, oid->subid_list, len))
+			return curr;
 	}
 
-	/*
-	 * The disk MIB: mounted partitions (UCD-SNMP-MIB.txt)
-	 * Caution: on changes, adapt the corresponding mib_build() section too!
-	 */
-	if (full) {
-		if (g_disk_list_length > 0) {
-			get_diskinfo(&u.diskinfo);
-			for (i = 0; i < g_disk_list_length; i++) {
-				if (mib_update_entry(&m_disk_oid, 6, i + 1, &pos, BER_TYPE_INTEGER, (const void *)(intptr_t)u.diskinfo.total[i]) == -1)
-					return -1;
-			}
+	return NULL;
+}
 
-			for (i = 0; i < g_disk_list_length; i++) {
-				if (mib_update_entry(&m_disk_oid, 7, i + 1, &pos, BER_TYPE_INTEGER, (const void *)(intptr_t)u.diskinfo.free[i]) == -1)
-					return -1;
-			}
+/* Find the OID in the MIB that is exactly the given one or a subid, its index is stored in @pos */
+value_t *mib_find(const oid_t *oid, size_t *pos)
+{
+	value_t *curr;
+	size_t len = oid->subid_list_length * sizeof(oid->subid_list[0]);
 
-			for (i = 0; i < g_disk_list_length; i++) {
-				if (mib_update_entry(&m_disk_oid, 8, i + 1, &pos, BER_TYPE_INTEGER, (const void *)(intptr_t)u.diskinfo.used[i]) == -1)
-					return -1;
-			}
+	*pos = mib_search(oid, 0);
+	if (*pos >= g_mib_length)
+		return NULL;
 
-			for (i = 0; i < g_disk_list_length; i++) {
-				if (mib_update_entry(&m_disk_oid, 9, i + 1, &pos, BER_TYPE_INTEGER, (const void *)(intptr_t)u.diskinfo.blocks_used_percent[i]) == -1)
-					return -1;
-			}
+	curr = &g_mib[*pos];
+	if (curr->oid.subid_list_length >= oid->subid_list_length &&
+	    !memcmp(curr->oid.subid_list, oid->subid_list, len))
+		return curr;
 
-			for (i = 0; i < g_disk_list_length; i++) {
-				if (mib_update_entry(&m_disk_oid, 10, i + 1, &pos, BER_TYPE_INTEGER, (const void *)(intptr_t)u.diskinfo.inodes_used_percent[i]) == -1)
-					return -1;
-			}
-		}
-	}
+	*pos = g_mib_length;
 
-	/*
-	 * The load MIB: CPU load averages (UCD-SNMP-MIB.txt)
-	 * Caution: on changes, adapt the corresponding mib_build() section too!
-	 */
-	if (full) {
-		get_loadinfo(&u.loadinfo);
-		for (i = 0; i < 3; i++) {
-			snprintf(nr, sizeof(nr), "%d.%02d", u.loadinfo.avg[i] / 100, u.loadinfo.avg[i] % 100);
-			if (mib_update_entry(&m_load_oid, 3, i + 1, &pos, BER_TYPE_OCTET_STRING, nr) == -1)
-				return -1;
-		}
+	return NULL;
+}
 
-		for (i = 0; i < 3; i++) {
-			if (mib_update_entry(&m_load_oid, 5, i + 1, &pos, BER_TYPE_INTEGER, (const void *)(intptr_t)u.loadinfo.avg[i]) == -1)
-				return -1;
-		}
-	}
+/*
+ * The virtual column of the changes MIB, .2.N.<OID>: the entries after
+ * <OID> that changed since generation N, prefixed with .2.N.  Its entries
+ * are only returned for an @oid within .2.N, walking into the column from
+ * outside skips it, there would be an entry for every generation.  The
+ * value returned is per thread, valid until the next call.
+ *
+ * The OIDs of the column are kept compact, see OID_CHANGES, so oid_t and
+ * everything holding one need not be sized for them.
+ */
+static __thread value_t m_change;
 
-	/*
-	 * The cpu MIB: CPU statistics (UCD-SNMP-MIB.txt)
-	 * Caution: on changes, adapt the corresponding mib_build() section too!
-	 */
-	if (full) {
-		get_cpuinfo(&u.cpuinfo);
-		if (mib_update_entry(&m_cpu_oid, 50, 0, &pos, BER_TYPE_COUNTER, (const void *)(uintptr_t)u.cpuinfo.user)   == -1 ||
-		    mib_update_entry(&m_cpu_oid, 51, 0, &pos, BER_TYPE_COUNTER, (const void *)(uintptr_t)u.cpuinfo.nice)   == -1 ||
-		    mib_update_entry(&m_cpu_oid, 52, 0, &pos, BER_TYPE_COUNTER, (const void *)(uintptr_t)u.cpuinfo.system) == -1 ||
-		    mib_update_entry(&m_cpu_oid, 53, 0, &pos, BER_TYPE_COUNTER, (const void *)(uintptr_t)u.cpuinfo.idle)   == -1 ||
-		    mib_update_entry(&m_cpu_oid, 59, 0, &pos, BER_TYPE_COUNTER, (const void *)(uintptr_t)u.cpuinfo.irqs)   == -1 ||
-		    mib_update_entry(&m_cpu_oid, 60, 0, &pos, BER_TYPE_COUNTER, (const void *)(uintptr_t)u.cpuinfo.cntxts) == -1)
-			return -1;
-	}
+/* Called by the decoder once @oid has OID_CHANGES_PREFIX subids */
+int mib_oid_compact(oid_t *oid)
+{
+	const size_t len = m_changes_oid.subid_list_length;
 
-	/*
-	 * The demo MIB: two random integers (note: the random number is only
-	 * updated every "g_timeout" seconds; if you want it updated every SNMP
-	 * request, remove the enclosing "if" block).
-	 * Caution: on changes, adapt the corresponding mib_build() section too!
-	 */
-#ifdef CONFIG_ENABLE_DEMO
-	if (full) {
-		get_demoinfo(&u.demoinfo);
-		if (mib_update_entry(&m_demo_oid, 1, 0, &pos, BER_TYPE_INTEGER, (const void *)(intptr_t)u.demoinfo.random_value_1) == -1 ||
-		    mib_update_entry(&m_demo_oid, 2, 0, &pos, BER_TYPE_INTEGER, (const void *)(intptr_t)u.demoinfo.random_value_2) == -1)
-			return -1;
+	if (oid->subid_list_length != OID_CHANGES_PREFIX || oid->subid_list[len] != 2 ||
+	    memcmp(oid->subid_list, m_changes_oid.subid_list, len * sizeof(oid->subid_list[0])))
+		return 0;
+
+	oid->subid_list[0] = OID_CHANGES;
+	oid->subid_list[1] = oid->subid_list[OID_CHANGES_PREFIX - 1];
+	oid->subid_list_length = 2;
+
+	return 1;
+}
+
+/* The subids of @oid, expanded into @buf if it is compact */
+const unsigned int *mib_oid_subids(const oid_t *oid, unsigned int *buf, size_t *num)
+{
+	const size_t len = m_changes_oid.subid_list_length;
+
+	if (oid->subid_list_length < 2 || oid->subid_list[0] != OID_CHANGES) {
+		*num = oid->subid_list_length;
+		return oid->subid_list;
 	}
-#endif
 
-	return 0;
+	memcpy(buf, m_changes_oid.subid_list, len * sizeof(buf[0]));
+	buf[len] = 2;
+	buf[len + 1] = oid->subid_list[1];
+	memcpy(&buf[OID_CHANGES_PREFIX], &oid->subid_list[2], (oid->subid_list_length - 2) * sizeof(buf[0]));
+	*num = OID_CHANGES_PREFIX + oid->subid_list_length - 2;
+
+	return buf;
 }
 
-/* Find the OID in the MIB that is exactly the given one or a subid */
-value_t *mib_find(const oid_t *oid, size_t *pos)
+/* Compact OIDs, or .2 itself */
+static int changes_oid(const oid_t *oid)
 {
-	while (*pos < g_mib_length) {
-		value_t *curr = &g_mib[*pos];
-		size_t len = oid->subid_list_length * sizeof(oid->subid_list[0]);
+	const size_t len = m_changes_oid.subid_list_length;
 
-		if (curr->oid.subid_list_length >= oid->subid_list_length &&
-		    !memcmp(curr->oid.subid_list, oid->subid_list, len))
-			return curr;
-		*pos = *pos + 1;
+	if (oid->subid_list_length >= 2 && oid->subid_list[0] == OID_CHANGES)
+		return 1;
+
+	return oid->subid_list_length > len && oid->subid_list[len] == 2 &&
+	       !memcmp(oid->subid_list, m_changes_oid.subid_list, len * sizeof(oid->subid_list[0]));
+}
+
+static value_t *changes_findnext(const oid_t *oid)
+{
+	unsigned int gen;
+	oid_t from;
+	size_t pos;
+
+	if (oid->subid_list[0] == OID_CHANGES) {
+		/* @oid may be m_change.oid, from the previous call */
+		gen = oid->subid_list[1];
+		from.subid_list_length = oid->subid_list_length - 2;
+		memcpy(from.subid_list, &oid->subid_list[2], from.subid_list_length * sizeof(from.subid_list[0]));
+
+		for (pos = mib_search(&from, from.subid_list_length > 0); pos < g_mib_length; pos++) {
+			value_t *value = &g_mib[pos];
+
+			/* Getters change all the time, also the generation itself */
+			if (value->gen <= gen || value->get ||
+			    value->oid.subid_list_length > MAX_NR_SUBIDS - 2)
+				continue;
+
+			memcpy(&m_change, value, sizeof(m_change));
+			m_change.oid.subid_list[0] = OID_CHANGES;
+			m_change.oid.subid_list[1] = gen;
+			memcpy(&m_change.oid.subid_list[2], value->oid.subid_list,
+			       value->oid.subid_list_length * sizeof(value->oid.subid_list[0]));
+			m_change.oid.subid_list_length = 2 + value->oid.subid_list_length;
+			m_change.encoded_oid = NULL;
+			if (encode_oid_len(&m_change.oid))
+				continue;
+
+			return &m_change;
+		}
 	}
 
-	return NULL;
+	/* Done, or no N given: the entry after the virtual column */
+	memcpy(&from, &m_changes_oid, sizeof(from));
+	from.subid_list[from.subid_list_length++] = 3;
+	pos = mib_search(&from, 0);
+	if (pos >= g_mib_length)
+		return NULL;
+
+	return &g_mib[pos];
 }
 
 /* Find the OID in the MIB that is the one after the given one */
@@ -965,12 +1577,14 @@ value_t *mib_findnext(const oid_t *oid)
 {
 	size_t pos;
 
-	for (pos = 0; pos < g_mib_length; pos++) {
-		if (oid_cmp(&g_mib[pos].oid, oid) > 0)
-			return &g_mib[pos];
-	}
+	if (changes_oid(oid))
+		return changes_findnext(oid);
 
-	return NULL;
+	pos = mib_search(oid, 1);
+	if (pos >= g_mib_length)
+		return NULL;
+
+	return &g_mib[pos];
 }
 
 /* vim: ts=4 sts=4 sw=4 nowrap
@@ -16,8 +16,14 @@
 #define _GNU_SOURCE
 
 #include <sys/types.h>
+#include <sys/epoll.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sched.h>
+#endif
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <netinet/in.h>
 #include <net/if.h>
 #include <arpa/inet.h>
@@ -29,6 +35,7 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <time.h>
 
 #include "mini_snmpd.h"
@@ -48,6 +55,13 @@ static void print_help(void)
 	       "  -f, --file=FILE                 Configuration file. Default: " CONFDIR "/%s.conf\n"
 #endif
 	       "  -p, --udp-port PORT             UDP port to bind to, default: 161\n"
+	       "  -R, --udp-rcvbuf BYTES          UDP socket receive buffer size, default: system\n"
+	       "  -S, --udp-sndbuf BYTES          UDP socket send buffer size, default: system\n"
+	       "  -x, --dedup-window SEC          Answer retransmitted UDP requests from a cache, default: off\n"
+	       "  -N, --bulk-varbinds NUM         Cut GETBULK responses short after NUM varbinds, default: 192\n"
+	       "  -B, --bulk-bytes BYTES          ... after BYTES of varbinds, default: what fits a packet\n"
+	       "  -E, --bulk-time MSEC            ... after MSEC milliseconds, default: unlimited\n"
+	       "  -o, --shed-watermark PCT        Shed GETBULK and large GETNEXT above PCT%% backlog, default: off\n"
 	       "  -P, --tcp-port PORT             TCP port to bind to, default: 161\n"
 	       "  -c, --community STR             Community string, default: public\n"
 	       "  -D, --description STR           System description, default: none\n"
@@ -58,9 +72,20 @@ static void print_help(void)
 	       "  -i, --interfaces IFACE          Network interfaces to monitor, default: none\n"
 #ifdef __linux__
 	       "  -w, --wireless-interfaces IFACE Wireless network interfaces to monitor, default: none\n"
+	       "  -A, --auto-interfaces           Monitor all network interfaces, as they come and go\n"
+	       "  -l, --low-latency               Busy poll the UDP socket and lock all memory\n"
+	       "  -b, --cpu CPU                   Pin the serving thread to CPU, default: none\n"
+	       "  -r, --realtime PRIO             Serve with SCHED_FIFO priority PRIO, default: none\n"
+	       "  -W, --workers NUM               Handle requests in NUM worker threads, default: none\n"
 #endif
 	       "  -I, --listen IFACE              Network interface to listen, default: all\n"
 	       "  -t, --timeout SEC               Timeout for MIB updates, default: 1 second\n"
+	       "  -y, --max-staleness SEC         Refresh ahead of the observed polls, at least every SEC\n"
+	       "  -m, --max-clients NUM           Maximum number of TCP clients, default: 16\n"
+	       "  -T, --idle-timeout SEC          Disconnect idle TCP clients after SEC seconds, default: never\n"
+#ifdef CONFIG_ENABLE_IO_URING
+	       "  -U, --io-uring                  Serve the UDP and TCP sockets with io_uring, if available\n"
+#endif
 	       "  -a, --auth                      Enable authentication, i.e. SNMP version 2c\n"
 	       "  -n, --foreground                Run in foreground, do not detach from controlling terminal\n"
 	       "  -s, --syslog                    Use syslog for logging, even if running in the foreground\n"
@@ -78,6 +103,259 @@ static void handle_signal(int UNUSED(signo))
 	g_quit = 1;
 }
 
+/*
+ * epoll user data of the fixed event sources, TCP clients are registered
+ * with their client_t pointer, which can never be one of these values.
+ */
+#define EV_UDP                                          1
+#define EV_TCP                                          2
+#define EV_NETLINK                                      3
+#define EV_MOUNTS                                       4
+#define EV_WORKERS                                      5
+#define EV_TIMER                                        16
+
+static int m_epoll_fd = -1;
+static int m_uring = 0;
+static int m_timer_fd[MIB_REFRESH_MAX];
+#ifdef __linux__
+static int m_netlink_fd = -1;
+static int m_mounts_fd = -1;
+static int m_worker_fd = -1;
+static int m_udp_paused = 0;
+#endif
+
+static int event_add(int fd, uint32_t events, uint64_t data)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.u64 = data;
+	if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		lprintf(LOG_ERR, "could not add descriptor %d to event loop: %m\n", fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Each refresh class has its own periodic timer, immune to wall clock changes */
+static int timer_create_refresh(int class)
+{
+	int fd;
+	struct itimerspec its;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd == -1) {
+		lprintf(LOG_ERR, "could not create MIB refresh timer: %m\n");
+		return -1;
+	}
+
+	memset(&its, 0, sizeof(its));
+	its.it_interval.tv_sec  = g_timeout / 100;
+	its.it_interval.tv_nsec = (g_timeout % 100) * 10000000;
+	if (g_timeout <= 0)
+		its.it_interval.tv_nsec = 10000000;
+	its.it_value = its.it_interval;
+
+	/* Adaptive scheduling re-arms the timer after each refresh, see sched.c */
+	if (g_max_staleness > 0) {
+		memset(&its.it_interval, 0, sizeof(its.it_interval));
+		sched_refreshed(class, sched_now());
+	}
+
+	if (timerfd_settime(fd, 0, &its, NULL) == -1) {
+		lprintf(LOG_ERR, "could not arm MIB refresh timer: %m\n");
+		close(fd);
+		return -1;
+	}
+
+	m_timer_fd[class] = fd;
+
+	return event_add(fd, EPOLLIN, EV_TIMER + class);
+}
+
+/* Arm the timer of @class for the refresh sched_next() picks */
+static void timer_schedule(int class)
+{
+	struct itimerspec its;
+	int64_t next;
+
+	next = sched_next(class);
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec  = next / 1000;
+	its.it_value.tv_nsec = (next % 1000) * 1000000;
+	if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+		its.it_value.tv_nsec = 1;
+	if (timerfd_settime(m_timer_fd[class], TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+		lprintf(LOG_ERR, "could not arm MIB refresh timer: %m\n");
+		exit(EXIT_SYSCALL);
+	}
+}
+
+#ifdef __linux__
+/* The set of interfaces or block devices changed, the tables must be laid out anew */
+static void rebuild_mib(void)
+{
+	int c;
+
+	if (mib_build() == -1)
+		exit(EXIT_SYSCALL);
+	for (c = 0; c < MIB_REFRESH_MAX; c++) {
+		if (mib_update(c) == -1)
+			exit(EXIT_SYSCALL);
+	}
+}
+#endif
+
+static void handle_timer(int class)
+{
+	uint64_t expirations;
+	int64_t start;
+
+	if (read(m_timer_fd[class], &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;
+
+	lprintf(LOG_DEBUG, "updating the MIB (class %d)\n", class);
+	start = sched_now();
+	if (mib_update(class) == -1)
+		exit(EXIT_SYSCALL);
+
+#ifdef __linux__
+	if (class == MIB_REFRESH_DISKIO && diskio_changed()) {
+		lprintf(LOG_DEBUG, "block devices changed, rebuilding the MIB\n");
+		rebuild_mib();
+	}
+#endif
+
+	if (g_max_staleness > 0) {
+		sched_refreshed(class, start);
+		timer_schedule(class);
+	}
+
+#ifdef DEBUG
+	dump_mib(g_mib, g_mib_length);
+#endif
+}
+
+#ifdef __linux__
+static void handle_netlink(void)
+{
+	switch (netlink_recv()) {
+	case 2:
+		lprintf(LOG_DEBUG, "interfaces changed, rebuilding the MIB\n");
+		rebuild_mib();
+		break;
+
+	case 1:
+		if (mib_update(MIB_REFRESH_NET) == -1)
+			exit(EXIT_SYSCALL);
+		break;
+
+	default:
+		return;
+	}
+
+#ifdef DEBUG
+	dump_mib(g_mib, g_mib_length);
+#endif
+}
+
+/* The mount table changed, pick up the new devices of the disks */
+static void handle_mounts(void)
+{
+	if (mounts_update() <= 0)
+		return;
+
+	if (mib_update(MIB_REFRESH_DISK) == -1)
+		exit(EXIT_SYSCALL);
+}
+
+/*
+ * Low-latency mode: spin in the kernel for a while waiting for datagrams,
+ * rather than sleeping, needs net.core.busy_poll or CAP_NET_ADMIN.
+ */
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL                             69
+#endif
+#define BUSY_POLL_USEC                                  50
+
+static void low_latency_socket(int sd)
+{
+	int val = BUSY_POLL_USEC;
+
+	if (setsockopt(sd, SOL_SOCKET, SO_BUSY_POLL, &val, sizeof(val)) == -1) {
+		lprintf(LOG_WARNING, "could not enable busy polling on UDP socket: %m\n");
+		return;
+	}
+
+	val = 1;
+	if (setsockopt(sd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &val, sizeof(val)) == -1)
+		lprintf(LOG_DEBUG, "could not prefer busy polling on UDP socket: %m\n");
+}
+
+/*
+ * Pin and prioritize the serving thread and lock the MIB and buffers in
+ * memory.  Called last, the statfs workers are already running by then
+ * and keep the default scheduling and affinity.
+ */
+static void low_latency_setup(void)
+{
+	struct sched_param param;
+	cpu_set_t set;
+
+	if (g_cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(g_cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) == -1)
+			lprintf(LOG_WARNING, "could not pin to CPU %d: %m\n", g_cpu);
+	}
+
+	if (g_realtime > 0) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = g_realtime;
+		if (sched_setscheduler(0, SCHED_FIFO, &param) == -1)
+			lprintf(LOG_WARNING, "could not set SCHED_FIFO priority %d: %m\n", g_realtime);
+	}
+
+	if (g_low_latency && mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+		lprintf(LOG_WARNING, "could not lock memory: %m\n");
+}
+#endif
+
+/*
+ * Size the UDP socket buffers, beyond net.core.rmem_max and wmem_max if
+ * allowed to, and have the kernel report the datagrams it dropped.
+ */
+static void udp_socket_setup(int sd)
+{
+	int val;
+
+	if (g_udp_rcvbuf > 0) {
+#ifdef SO_RCVBUFFORCE
+		if (setsockopt(sd, SOL_SOCKET, SO_RCVBUFFORCE, &g_udp_rcvbuf, sizeof(g_udp_rcvbuf)) == -1)
+#endif
+		if (setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &g_udp_rcvbuf, sizeof(g_udp_rcvbuf)) == -1)
+			lprintf(LOG_WARNING, "could not set UDP receive buffer size %d: %m\n", g_udp_rcvbuf);
+	}
+
+	if (g_udp_sndbuf > 0) {
+#ifdef SO_SNDBUFFORCE
+		if (setsockopt(sd, SOL_SOCKET, SO_SNDBUFFORCE, &g_udp_sndbuf, sizeof(g_udp_sndbuf)) == -1)
+#endif
+		if (setsockopt(sd, SOL_SOCKET, SO_SNDBUF, &g_udp_sndbuf, sizeof(g_udp_sndbuf)) == -1)
+			lprintf(LOG_WARNING, "could not set UDP send buffer size %d: %m\n", g_udp_sndbuf);
+	}
+
+#ifdef SO_RXQ_OVFL
+	val = 1;
+	if (setsockopt(sd, SOL_SOCKET, SO_RXQ_OVFL, &val, sizeof(val)) == -1)
+		lprintf(LOG_WARNING, "could not enable UDP drop counter: %m\n");
+#else
+	(void)val;
+#endif
+}
+
 static void handle_udp_client(void)
 {
 	const char *req_msg = "Failed UDP request from";
@@ -86,17 +364,30 @@ static void handle_udp_client(void)
 	char straddr[my_inet_addrstrlen] = "";
 	my_socklen_t socklen;
 	struct my_sockaddr_t sockaddr;
+	struct iovec iov = { g_udp_client.packet, sizeof(g_udp_client.packet) };
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(uint32_t))];
+	} control;
+	struct msghdr msg = {
+		.msg_name       = &sockaddr,
+		.msg_namelen    = sizeof(sockaddr),
+		.msg_iov        = &iov,
+		.msg_iovlen     = 1,
+		.msg_control    = &control,
+		.msg_controllen = sizeof(control),
+	};
 
-	/* Read the whole UDP packet from the socket at once */
-	socklen = sizeof(sockaddr);
-	rv = recvfrom(g_udp_sockfd, g_udp_client.packet, sizeof(g_udp_client.packet),
-		      0, (struct sockaddr *)&sockaddr, &socklen);
+	/* Read the whole UDP packet from the socket at once, with the kernel's drop count */
+	rv = recvmsg(g_udp_sockfd, &msg, 0);
 	if (rv == -1) {
 		lprintf(LOG_WARNING, "Failed receiving UDP request on port %d: %m\n", g_udp_port);
 		return;
 	}
+	socklen = msg.msg_namelen;
+	udp_drops_update(&msg);
 
-	g_udp_client.timestamp = time(NULL);
+	g_udp_client.timestamp = monotonic_time();
 	g_udp_client.sockfd = g_udp_sockfd;
 	g_udp_client.addr = sockaddr.my_sin_addr;
 	g_udp_client.port = sockaddr.my_sin_port;
@@ -106,17 +397,31 @@ static void handle_udp_client(void)
 	dump_packet(&g_udp_client);
 #endif
 
-	/* Call the protocol handler which will prepare the response packet */
-	inet_ntop(my_af_inet, &sockaddr.my_sin_addr, straddr, sizeof(straddr));
-	if (snmp(&g_udp_client) == -1) {
-		lprintf(LOG_WARNING, "%s %s:%d: %m\n", req_msg, straddr, sockaddr.my_sin_port);
-		return;
-	}
-	if (g_udp_client.size == 0) {
-		lprintf(LOG_WARNING, "%s %s:%d: ignored\n", req_msg, straddr, sockaddr.my_sin_port);
+	/* A retransmission gets the response sent to the original again */
+	rv = dedup_check(&g_udp_client);
+	if (rv == -1)
 		return;
+	if (rv == 0) {
+		udp_load_update(0);
+		if (snmp_admit(&g_udp_client)) {
+			g_udp_client.size = 0;
+			dedup_done(&g_udp_client);
+			return;
+		}
+
+		/* Call the protocol handler which will prepare the response packet */
+		inet_ntop(my_af_inet, &sockaddr.my_sin_addr, straddr, sizeof(straddr));
+		if (snmp(&g_udp_client) == -1) {
+			lprintf(LOG_WARNING, "%s %s:%d: %m\n", req_msg, straddr, sockaddr.my_sin_port);
+			g_udp_client.size = 0;
+		} else if (g_udp_client.size == 0) {
+			lprintf(LOG_WARNING, "%s %s:%d: ignored\n", req_msg, straddr, sockaddr.my_sin_port);
+		}
+		dedup_done(&g_udp_client);
+		if (g_udp_client.size == 0)
+			return;
+		g_udp_client.outgoing = 1;
 	}
-	g_udp_client.outgoing = 1;
 
 	/* Send the whole UDP packet to the socket at once */
 	rv = sendto(g_udp_sockfd, g_udp_client.packet, g_udp_client.size,
@@ -132,165 +437,667 @@ static void handle_udp_client(void)
 #endif
 }
 
-static void handle_tcp_connect(void)
+#ifdef __linux__
+/* Stop reading requests while all jobs are with the workers, the socket buffers them */
+static void udp_pause(int pause)
+{
+	struct epoll_event ev;
+
+	if (pause == m_udp_paused)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = pause ? 0 : EPOLLIN;
+	ev.data.u64 = EV_UDP;
+	if (epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, g_udp_sockfd, &ev) == -1) {
+		lprintf(LOG_ERR, "could not update UDP socket events: %m\n");
+		exit(EXIT_SYSCALL);
+	}
+	m_udp_paused = pause;
+}
+
+/* Receive what is queued on the UDP socket and hand it to the workers */
+static void handle_udp_jobs(void)
+{
+	struct iovec iov;
+	struct msghdr msg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(uint32_t))];
+	} control;
+	char straddr[my_inet_addrstrlen] = "";
+	client_t *client;
+	job_t *job;
+	ssize_t rv;
+	int i;
+
+	udp_load_update(worker_load());
+	for (i = 0; i < 32; i++) {
+		job = worker_job();
+		if (!job) {
+			udp_pause(1);
+			return;
+		}
+
+		client = &job->client;
+		iov.iov_base = client->packet;
+		iov.iov_len = sizeof(client->packet);
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &job->peer;
+		msg.msg_namelen = sizeof(job->peer);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = &control;
+		msg.msg_controllen = sizeof(control);
+
+		rv = recvmsg(g_udp_sockfd, &msg, MSG_DONTWAIT);
+		if (rv == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				lprintf(LOG_WARNING, "Failed receiving UDP request on port %d: %m\n", g_udp_port);
+			worker_put(job);
+			return;
+		}
+		udp_drops_update(&msg);
+
+		job->peerlen = msg.msg_namelen;
+		job->owner = NULL;
+		client->timestamp = monotonic_time();
+		client->sockfd = g_udp_sockfd;
+		client->addr = job->peer.my_sin_addr;
+		client->port = job->peer.my_sin_port;
+		client->size = rv;
+		client->outgoing = 0;
+#ifdef DEBUG
+		dump_packet(client);
+#endif
+
+		switch (dedup_check(client)) {
+		case -1:
+			worker_put(job);
+			continue;
+
+		case 1:
+			if (sendto(g_udp_sockfd, client->packet, client->size, MSG_DONTWAIT,
+				   (struct sockaddr *)&job->peer, job->peerlen) == -1) {
+				inet_ntop(my_af_inet, &client->addr, straddr, sizeof(straddr));
+				lprintf(LOG_WARNING, "Failed UDP response to %s:%d: %m\n", straddr, client->port);
+			}
+			worker_put(job);
+			continue;
+		}
+
+		if (snmp_admit(client)) {
+			client->size = 0;
+			dedup_done(client);
+			worker_put(job);
+			continue;
+		}
+
+		/* There is always room when there was a free job */
+		if (worker_submit(job)) {
+			client->size = 0;
+			dedup_done(client);
+			worker_put(job);
+			return;
+		}
+	}
+}
+#endif
+
+static void tcp_client_close(client_t *client)
+{
+	close(client->sockfd);
+	tcp_client_free(client);
+}
+
+/* Take on an accepted, non-blocking, connection */
+static void tcp_client_add(int sd, struct my_sockaddr_t *sockaddr)
 {
-	int rv;
 	const char *msg = "Could not accept TCP connection";
 	char straddr[my_inet_addrstrlen] = "";
 	client_t *client;
-	my_socklen_t socklen;
 	struct my_sockaddr_t tmp_sockaddr;
+
+	/* Make room for the new client by kicking out the least recently active one */
+	if (g_tcp_client_list_length >= g_tcp_max_clients) {
+		client = tcp_client_oldest();
+		if (!client) {
+			lprintf(LOG_ERR, "%s: internal error", msg);
+			exit(EXIT_SYSCALL);
+		}
+
+		tmp_sockaddr.my_sin_addr = client->addr;
+		tmp_sockaddr.my_sin_port = client->port;
+		inet_ntop(my_af_inet, &tmp_sockaddr.my_sin_addr, straddr, sizeof(straddr));
+		lprintf(LOG_WARNING, "Maximum number of %zu clients reached, kicking out %s:%d\n",
+			g_tcp_max_clients, straddr, tmp_sockaddr.my_sin_port);
+		tcp_client_close(client);
+	}
+
+	client = tcp_client_alloc();
+	if (!client) {
+		lprintf(LOG_ERR, "%s: %m", msg);
+		exit(EXIT_SYSCALL);
+	}
+
+	client->events = EPOLLIN;
+	if (event_add(sd, client->events, (uintptr_t)client) == -1) {
+		close(sd);
+		tcp_client_free(client);
+		return;
+	}
+
+	/* Now fill out the client control structure values */
+	inet_ntop(my_af_inet, &sockaddr->my_sin_addr, straddr, sizeof(straddr));
+	lprintf(LOG_DEBUG, "Connected TCP client %s:%d\n",
+		straddr, sockaddr->my_sin_port);
+	client->timestamp = monotonic_time();
+	client->sockfd = sd;
+	client->addr = sockaddr->my_sin_addr;
+	client->port = sockaddr->my_sin_port;
+}
+
+static void handle_tcp_connect(void)
+{
+	int rv;
+	const char *msg = "Could not accept TCP connection";
+	my_socklen_t socklen;
 	struct my_sockaddr_t sockaddr;
 
 	/* Accept the new connection (remember the client's IP address and port) */
 	socklen = sizeof(sockaddr);
 	rv = accept(g_tcp_sockfd, (struct sockaddr *)&sockaddr, &socklen);
 	if (rv == -1) {
-		lprintf(LOG_ERR, "%s: %m\n", msg);
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			lprintf(LOG_ERR, "%s: %m\n", msg);
 		return;
 	}
-	if (rv >= FD_SETSIZE) {
-		lprintf(LOG_ERR, "%s: FD set overflow\n", msg);
+	if (fcntl(rv, F_SETFL, fcntl(rv, F_GETFL) | O_NONBLOCK) == -1) {
+		lprintf(LOG_ERR, "%s: %m\n", msg);
 		close(rv);
 		return;
 	}
 
-	/* Create a new client control structure or overwrite the oldest one */
-	if (g_tcp_client_list_length >= MAX_NR_CLIENTS) {
-		client = find_oldest_client();
-		if (!client) {
-			lprintf(LOG_ERR, "%s: internal error", msg);
-			exit(EXIT_SYSCALL);
-		}
+	tcp_client_add(rv, &sockaddr);
+}
 
-		tmp_sockaddr.my_sin_addr = client->addr;
-		tmp_sockaddr.my_sin_port = client->port;
-		inet_ntop(my_af_inet, &tmp_sockaddr.my_sin_addr, straddr, sizeof(straddr));
-		lprintf(LOG_WARNING, "Maximum number of %d clients reached, kicking out %s:%d\n",
-			MAX_NR_CLIENTS, straddr, tmp_sockaddr.my_sin_port);
-		close(client->sockfd);
-	} else {
-		client = allocate(sizeof(client_t));
-		if (!client) {
-			lprintf(LOG_ERR, "%s: %m", msg);
-			exit(EXIT_SYSCALL);
+#ifdef CONFIG_ENABLE_IO_URING
+/* Connections accepted by the ring are already non-blocking, only the peer is missing */
+static void handle_uring_accepted(void)
+{
+	my_socklen_t socklen;
+	struct my_sockaddr_t sockaddr;
+	int sd;
+
+	while ((sd = uring_accepted()) != -1) {
+		socklen = sizeof(sockaddr);
+		if (getpeername(sd, (struct sockaddr *)&sockaddr, &socklen) == -1) {
+			close(sd);
+			continue;
 		}
-		g_tcp_client_list[g_tcp_client_list_length++] = client;
-	}
 
-	/* Now fill out the client control structure values */
-	inet_ntop(my_af_inet, &sockaddr.my_sin_addr, straddr, sizeof(straddr));
-	lprintf(LOG_DEBUG, "Connected TCP client %s:%d\n",
-		straddr, sockaddr.my_sin_port);
-	client->timestamp = time(NULL);
-	client->sockfd = rv;
-	client->addr = sockaddr.my_sin_addr;
-	client->port = sockaddr.my_sin_port;
-	client->size = 0;
-	client->outgoing = 0;
+		tcp_client_add(sd, &sockaddr);
+	}
 }
+#endif
 
-static void handle_tcp_client_write(client_t *client)
+/* Send as much of the queued responses as the socket accepts */
+static int tcp_client_send(client_t *client)
 {
 	const char *msg = "Failed TCP response to";
 	ssize_t rv;
 	char straddr[my_inet_addrstrlen] = "";
 	struct my_sockaddr_t sockaddr;
 
-	/* Send the packet atomically and close socket if that did not work */
-	sockaddr.my_sin_addr = client->addr;
-	sockaddr.my_sin_port = client->port;
-	rv = send(client->sockfd, client->packet, client->size, 0);
-	inet_ntop(my_af_inet, &sockaddr.my_sin_addr, straddr, sizeof(straddr));
+	rv = send(client->sockfd, client->wbuf + client->wpos, client->wlen - client->wpos, MSG_NOSIGNAL);
 	if (rv == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+
+		sockaddr.my_sin_addr = client->addr;
+		sockaddr.my_sin_port = client->port;
+		inet_ntop(my_af_inet, &sockaddr.my_sin_addr, straddr, sizeof(straddr));
 		lprintf(LOG_WARNING, "%s %s:%d: %m\n", msg, straddr, sockaddr.my_sin_port);
-		close(client->sockfd);
-		client->sockfd = -1;
-		return;
+		tcp_client_close(client);
+		return -1;
 	}
-	if ((size_t)rv != client->size) {
-		lprintf(LOG_WARNING, "%s %s:%d: only %zd of %zu bytes written\n",
-			msg, straddr, sockaddr.my_sin_port, rv, client->size);
-		close(client->sockfd);
-		client->sockfd = -1;
-		return;
+
+	client->timestamp = monotonic_time();
+	client->wpos += rv;
+	if (client->wpos == client->wlen) {
+		tcp_buffer_put(client->wbuf);
+		client->wbuf = NULL;
+		client->wlen = 0;
+		client->wpos = 0;
 	}
 
+	return 0;
+}
+
+#ifdef __linux__
+/* Hand a request to the workers, returns -1 if they are all busy */
+static int tcp_client_submit(client_t *client, const unsigned char *packet, size_t len)
+{
+	job_t *job;
+
+	job = worker_job();
+	if (!job)
+		return -1;
+
+	memcpy(job->client.packet, packet, len);
+	job->client.size = len;
+	job->client.outgoing = 0;
+	job->client.timestamp = client->timestamp;
+	job->client.sockfd = client->sockfd;
+	job->client.addr = client->addr;
+	job->client.port = client->port;
+	job->owner = client;
+	job->gen = client->gen;
+#ifdef DEBUG
+	dump_packet(&job->client);
+#endif
+
+	if (worker_submit(job)) {
+		worker_put(job);
+		return -1;
+	}
+	client->inflight++;
+
+	return 0;
+}
+#endif
+
+/*
+ * Handle all complete requests in the client's input buffer, in order, and
+ * queue the responses.  When there is no longer room for a full response in
+ * the output buffer the rest of the requests are held back until the socket
+ * has drained it.  With workers, room is also kept for the responses of the
+ * requests they have, and a request is only handled here when they are all
+ * busy and there are none, so the responses stay in order.
+ */
+static void handle_tcp_client_requests(client_t *client)
+{
+	const char *req_msg = "Failed TCP request from";
+	int rv, handled;
+	size_t pos;
+	char straddr[my_inet_addrstrlen] = "";
+	struct my_sockaddr_t sockaddr;
+
+	sockaddr.my_sin_addr = client->addr;
+	sockaddr.my_sin_port = client->port;
+	inet_ntop(my_af_inet, &sockaddr.my_sin_addr, straddr, sizeof(straddr));
+
+	while (1) {
+		handled = 0;
+		pos = 0;
+		while (pos < client->rlen && MAX_TCP_BUFFER_SIZE - client->wlen >= (client->inflight + 1) * MAX_PACKET_SIZE) {
+			/* Check whether the next packet was fully received */
+			rv = snmp_packet_complete(client->rbuf + pos, client->rlen - pos);
+			if (rv == -1) {
+				lprintf(LOG_WARNING, "%s %s:%d: %m\n", req_msg, straddr, sockaddr.my_sin_port);
+				tcp_client_close(client);
+				return;
+			}
+			if (rv == 0)
+				break;
+
+#ifdef __linux__
+			if (g_workers > 0) {
+				if (!tcp_client_submit(client, client->rbuf + pos, rv)) {
+					pos += rv;
+					continue;
+				}
+				if (client->inflight > 0)
+					break;
+			}
+#endif
+
+			memcpy(client->packet, client->rbuf + pos, rv);
+			client->size = rv;
+			client->outgoing = 0;
+			pos += rv;
+
+#ifdef DEBUG
+			dump_packet(client);
+#endif
+
+			/* Call the protocol handler which will prepare the response packet */
+			if (snmp(client) == -1) {
+				lprintf(LOG_WARNING, "%s %s:%d: %m\n", req_msg, straddr, sockaddr.my_sin_port);
+				tcp_client_close(client);
+				return;
+			}
+			if (client->size == 0) {
+				lprintf(LOG_WARNING, "%s %s:%d: ignored\n", req_msg, straddr, sockaddr.my_sin_port);
+				tcp_client_close(client);
+				return;
+			}
+
+			client->outgoing = 1;
 #ifdef DEBUG
-	dump_packet(client);
+			dump_packet(client);
 #endif
+			if (!client->wbuf) {
+				client->wbuf = tcp_buffer_get();
+				if (!client->wbuf) {
+					lprintf(LOG_WARNING, "%s %s:%d: %m\n", req_msg, straddr, sockaddr.my_sin_port);
+					tcp_client_close(client);
+					return;
+				}
+			}
+			memcpy(client->wbuf + client->wlen, client->packet, client->size);
+			client->wlen += client->size;
+			handled++;
+		}
 
-	/* Put the client into listening mode again */
-	client->size = 0;
-	client->outgoing = 0;
+		/* Keep any partially received request at the start of the buffer */
+		if (pos > 0) {
+			client->rlen -= pos;
+			memmove(client->rbuf, client->rbuf + pos, client->rlen);
+		}
+		if (client->rlen == 0) {
+			tcp_buffer_put(client->rbuf);
+			client->rbuf = NULL;
+		}
+
+		/* Try sending right away, most of the time the socket is writable */
+		if (client->wlen == 0)
+			break;
+		if (tcp_client_send(client))
+			return;
+		if (client->wlen > 0 || !handled)
+			break;
+	}
+}
+
+static void handle_tcp_client_write(client_t *client)
+{
+	if (tcp_client_send(client))
+		return;
+
+	/* All responses sent, continue with any requests held back */
+	if (client->wlen == 0 && client->rlen > 0)
+		handle_tcp_client_requests(client);
 }
 
 static void handle_tcp_client_read(client_t *client)
 {
 	const char *req_msg = "Failed TCP request from";
-	int rv;
+	ssize_t rv;
 	char straddr[my_inet_addrstrlen] = "";
 	struct my_sockaddr_t sockaddr;
 
 	/* Read from the socket what arrived and put it into the buffer */
 	sockaddr.my_sin_addr = client->addr;
 	sockaddr.my_sin_port = client->port;
-	rv = read(client->sockfd, client->packet + client->size, sizeof(client->packet) - client->size);
 	inet_ntop(my_af_inet, &sockaddr.my_sin_addr, straddr, sizeof(straddr));
+	if (!client->rbuf) {
+		client->rbuf = tcp_buffer_get();
+		if (!client->rbuf) {
+			lprintf(LOG_WARNING, "%s %s:%d: %m\n", req_msg, straddr, sockaddr.my_sin_port);
+			tcp_client_close(client);
+			return;
+		}
+	}
+	rv = read(client->sockfd, client->rbuf + client->rlen, MAX_TCP_BUFFER_SIZE - client->rlen);
 	if (rv == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return;
+
 		lprintf(LOG_WARNING, "%s %s:%d: %m\n", req_msg, straddr, sockaddr.my_sin_port);
-		close(client->sockfd);
-		client->sockfd = -1;
+		tcp_client_close(client);
 		return;
 	}
 	if (rv == 0) {
 		lprintf(LOG_DEBUG, "TCP client %s:%d disconnected\n",
 			straddr, sockaddr.my_sin_port);
-		close(client->sockfd);
-		client->sockfd = -1;
+		tcp_client_close(client);
 		return;
 	}
-	client->timestamp = time(NULL);
-	client->size += rv;
+	client->timestamp = monotonic_time();
+	client->rlen += rv;
 
-	/* Check whether the packet was fully received and handle packet if yes */
-	rv = snmp_packet_complete(client);
-	if (rv == -1) {
-		lprintf(LOG_WARNING, "%s %s:%d: %m\n", req_msg, straddr, sockaddr.my_sin_port);
-		close(client->sockfd);
-		client->sockfd = -1;
+	handle_tcp_client_requests(client);
+}
+
+/* Only wait for what the client can make progress on: input room, pending output */
+static void tcp_client_poll(client_t *client)
+{
+	uint32_t events = 0;
+	struct epoll_event ev;
+
+	if (client->rlen < MAX_TCP_BUFFER_SIZE)
+		events |= EPOLLIN;
+	if (client->wlen > client->wpos)
+		events |= EPOLLOUT;
+	if (events == client->events)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = client;
+	if (epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, client->sockfd, &ev) == -1) {
+		lprintf(LOG_WARNING, "could not update TCP client events: %m\n");
+		tcp_client_close(client);
 		return;
 	}
-	if (rv == 0) {
+	client->events = events;
+}
+
+static void handle_tcp_client_timeout(client_t *client)
+{
+	char straddr[my_inet_addrstrlen] = "";
+	struct my_sockaddr_t sockaddr;
+
+	sockaddr.my_sin_addr = client->addr;
+	sockaddr.my_sin_port = client->port;
+	inet_ntop(my_af_inet, &sockaddr.my_sin_addr, straddr, sizeof(straddr));
+	lprintf(LOG_DEBUG, "TCP client %s:%d idle for %d sec, disconnecting\n",
+		straddr, sockaddr.my_sin_port, g_tcp_idle_timeout);
+	tcp_client_close(client);
+}
+
+#ifdef __linux__
+/* Queue the response to a TCP request, unless the connection has gone since */
+static void tcp_client_complete(job_t *job)
+{
+	const char *req_msg = "Failed TCP request from";
+	char straddr[my_inet_addrstrlen] = "";
+	client_t *client = job->owner;
+
+	if (client->gen != job->gen || client->sockfd == -1) {
+		worker_put(job);
+		return;
+	}
+
+	client->inflight--;
+	if (!job->client.outgoing) {
+		worker_put(job);
+		tcp_client_close(client);
+		return;
+	}
+
+	if (!client->wbuf) {
+		client->wbuf = tcp_buffer_get();
+		if (!client->wbuf) {
+			inet_ntop(my_af_inet, &client->addr, straddr, sizeof(straddr));
+			lprintf(LOG_WARNING, "%s %s:%d: %m\n", req_msg, straddr, client->port);
+			worker_put(job);
+			tcp_client_close(client);
+			return;
+		}
+	}
+	memcpy(client->wbuf + client->wlen, job->client.packet, job->client.size);
+	client->wlen += job->client.size;
+	worker_put(job);
+
+	if (tcp_client_send(client))
 		return;
+	if (client->rlen > 0)
+		handle_tcp_client_requests(client);
+	if (client->sockfd != -1)
+		tcp_client_poll(client);
+}
+
+static void udp_send_jobs(job_t **jobs, struct mmsghdr *msgs, size_t num)
+{
+	char straddr[my_inet_addrstrlen] = "";
+	size_t i = 0;
+	int rv;
+
+	while (i < num) {
+		rv = sendmmsg(g_udp_sockfd, &msgs[i], num - i, MSG_DONTWAIT);
+		if (rv == -1) {
+			inet_ntop(my_af_inet, &jobs[i]->client.addr, straddr, sizeof(straddr));
+			lprintf(LOG_WARNING, "Failed UDP response to %s:%d: %m\n", straddr, jobs[i]->client.port);
+			i++;
+			continue;
+		}
+		i += rv;
 	}
-	client->outgoing = 0;
 
+	for (i = 0; i < num; i++)
+		worker_put(jobs[i]);
+}
+
+/* Send the responses the workers are done with, the UDP ones in batches */
+static void handle_workers(void)
+{
+	struct mmsghdr msgs[32];
+	struct iovec iov[32];
+	job_t *jobs[32];
+	size_t num = 0;
+	job_t *job;
+
+	while ((job = worker_done())) {
 #ifdef DEBUG
-	dump_packet(client);
+		if (job->client.outgoing)
+			dump_packet(&job->client);
 #endif
+		if (job->owner) {
+			tcp_client_complete(job);
+			continue;
+		}
+		dedup_done(&job->client);
+		if (!job->client.outgoing) {
+			worker_put(job);
+			continue;
+		}
 
-	/* Call the protocol handler which will prepare the response packet */
-	if (snmp(client) == -1) {
-		lprintf(LOG_WARNING, "%s %s:%d: %m\n", req_msg, straddr, sockaddr.my_sin_port);
-		close(client->sockfd);
-		client->sockfd = -1;
-		return;
+		iov[num].iov_base = job->client.packet;
+		iov[num].iov_len = job->client.size;
+		memset(&msgs[num], 0, sizeof(msgs[num]));
+		msgs[num].msg_hdr.msg_name = &job->peer;
+		msgs[num].msg_hdr.msg_namelen = job->peerlen;
+		msgs[num].msg_hdr.msg_iov = &iov[num];
+		msgs[num].msg_hdr.msg_iovlen = 1;
+		jobs[num++] = job;
+
+		if (num == NELEMS(msgs)) {
+			udp_send_jobs(jobs, msgs, num);
+			num = 0;
+		}
 	}
-	if (client->size == 0) {
-		lprintf(LOG_WARNING, "%s %s:%d: ignored\n", req_msg, straddr, sockaddr.my_sin_port);
-		close(client->sockfd);
-		client->sockfd = -1;
+	if (num > 0)
+		udp_send_jobs(jobs, msgs, num);
+
+	if (m_udp_paused)
+		udp_pause(0);
+}
+#endif
+
+/* Reschedule the refreshes of the classes whose poll cadence changed */
+static void handle_schedule(void)
+{
+	unsigned int changed;
+	int c;
+
+	if (g_max_staleness <= 0)
 		return;
+
+	changed = sched_changed();
+	for (c = 0; changed && c < MIB_REFRESH_MAX; c++) {
+		if (changed & (1u << c))
+			timer_schedule(c);
 	}
+}
+
+/* Drop TCP clients that have been idle for too long */
+static void handle_idle_clients(void)
+{
+	client_t *client;
+	time_t when;
 
-	client->outgoing = 1;
+	if (g_tcp_idle_timeout <= 0)
+		return;
+
+	when = monotonic_time() - g_tcp_idle_timeout;
+	while ((client = tcp_client_expired(when)))
+		handle_tcp_client_timeout(client);
 }
 
+/* Wait at most @timeout ms for events and dispatch them */
+static void handle_events(int timeout)
+{
+	struct epoll_event events[32];
+	int accept_pending = 0;
+	client_t *client;
+	int i, nfds;
+
+	nfds = epoll_wait(m_epoll_fd, events, NELEMS(events), timeout);
+	if (nfds == -1) {
+		if (g_quit || errno == EINTR)
+			return;
+
+		lprintf(LOG_ERR, "could not wait for events: %m\n");
+		exit(EXIT_SYSCALL);
+	}
+
+	for (i = 0; i < nfds; i++) {
+		uint64_t ev = events[i].data.u64;
+
+		if (ev == EV_UDP) {
+#ifdef __linux__
+			if (g_workers > 0) {
+				handle_udp_jobs();
+				continue;
+			}
+#endif
+			handle_udp_client();
+		} else if (ev == EV_TCP) {
+			/* Accepting may kick out a client with events still in this batch */
+			accept_pending = 1;
+		} else if (ev >= EV_TIMER && ev < EV_TIMER + MIB_REFRESH_MAX) {
+			handle_timer(ev - EV_TIMER);
+#ifdef __linux__
+		} else if (ev == EV_NETLINK) {
+			handle_netlink();
+		} else if (ev == EV_MOUNTS) {
+			handle_mounts();
+		} else if (ev == EV_WORKERS) {
+			uint64_t val;
+
+			if (read(m_worker_fd, &val, sizeof(val)) == -1 && errno != EAGAIN)
+				lprintf(LOG_WARNING, "could not read worker event: %m\n");
+#endif
+		} else {
+			client = events[i].data.ptr;
+			if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+				handle_tcp_client_write(client);
+			if (client->sockfd != -1 && events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+				handle_tcp_client_read(client);
+			if (client->sockfd != -1)
+				tcp_client_poll(client);
+		}
+	}
+
+	if (accept_pending)
+		handle_tcp_connect();
+}
 
 int main(int argc, char *argv[])
 {
-	static const char short_options[] = "p:P:c:D:V:L:C:d:i:w:t:ansvh"
+	static const char short_options[] = "p:R:S:x:N:B:E:o:P:c:D:V:L:C:d:i:w:Alb:r:W:t:y:m:T:ansvh"
 #ifndef __FreeBSD__
 		"I:"
 #endif
@@ -299,6 +1106,9 @@ int main(int argc, char *argv[])
 #endif
 #ifdef HAVE_LIBCONFUSE
 		"f:"
+#endif
+#ifdef CONFIG_ENABLE_IO_URING
+		"U"
 #endif
 		;
 	static const struct option long_options[] = {
@@ -310,6 +1120,13 @@ int main(int argc, char *argv[])
 		{ "file",     1, 0, 'f' },
 #endif
 		{ "udp-port", 1, 0, 'p' },
+		{ "udp-rcvbuf", 1, 0, 'R' },
+		{ "udp-sndbuf", 1, 0, 'S' },
+		{ "dedup-window", 1, 0, 'x' },
+		{ "bulk-varbinds", 1, 0, 'N' },
+		{ "bulk-bytes", 1, 0, 'B' },
+		{ "bulk-time", 1, 0, 'E' },
+		{ "shed-watermark", 1, 0, 'o' },
 		{ "tcp-port", 1, 0, 'P' },
 		{ "community", 1, 0, 'c' },
 		{ "description", 1, 0, 'D' },
@@ -320,11 +1137,22 @@ int main(int argc, char *argv[])
 		{ "interfaces", 1, 0, 'i' },
 #ifdef __linux__
 		{ "wireless-interfaces", 1, 0, 'w' },
+		{ "auto-interfaces", 0, 0, 'A' },
+		{ "low-latency", 0, 0, 'l' },
+		{ "cpu", 1, 0, 'b' },
+		{ "realtime", 1, 0, 'r' },
+		{ "workers", 1, 0, 'W' },
 #endif
 #ifndef __FreeBSD__
 		{ "listen", 1, 0, 'I' },
 #endif
 		{ "timeout", 1, 0, 't' },
+		{ "max-staleness", 1, 0, 'y' },
+		{ "max-clients", 1, 0, 'm' },
+		{ "idle-timeout", 1, 0, 'T' },
+#ifdef CONFIG_ENABLE_IO_URING
+		{ "io-uring", 0, 0, 'U' },
+#endif
 		{ "auth", 0, 0, 'a' },
 		{ "foreground", 0, 0, 'n' },
 		{ "verbose", 0, 0, 'v' },
@@ -332,14 +1160,13 @@ int main(int argc, char *argv[])
 		{ "help", 0, 0, 'h' },
 		{ NULL, 0, 0, 0 }
 	};
-	int ticks, nfds, c, option_index = 1;
-	size_t i;
-	fd_set rfds, wfds;
+	int c, option_index = 1;
+	long num;
+#ifdef CONFIG_ENABLE_IO_URING
+	int rc;
+#endif
 	struct sigaction sig;
 	struct ifreq ifreq;
-	struct timeval tv_last;
-	struct timeval tv_now;
-	struct timeval tv_sleep;
 	my_socklen_t socklen;
 	union {
 		struct sockaddr_in sa;
@@ -385,6 +1212,34 @@ int main(int argc, char *argv[])
 				g_udp_port = atoi(optarg);
 				break;
 
+			case 'R':
+				g_udp_rcvbuf = atoi(optarg);
+				break;
+
+			case 'S':
+				g_udp_sndbuf = atoi(optarg);
+				break;
+
+			case 'x':
+				g_dedup_window = atoi(optarg);
+				break;
+
+			case 'N':
+				g_bulk_varbinds = atoi(optarg);
+				break;
+
+			case 'B':
+				g_bulk_bytes = atoi(optarg);
+				break;
+
+			case 'E':
+				g_bulk_time = atoi(optarg);
+				break;
+
+			case 'o':
+				g_shed_watermark = atoi(optarg);
+				break;
+
 			case 'P':
 				g_tcp_port = atoi(optarg);
 				break;
@@ -424,11 +1279,53 @@ int main(int argc, char *argv[])
 			case 'w':
 				g_wireless_list_length = split(optarg, ",;", g_wireless_list, MAX_NR_INTERFACES);
 				break;
+
+			case 'A':
+				g_interface_auto = 1;
+				break;
+
+			case 'l':
+				g_low_latency = 1;
+				break;
+
+			case 'b':
+				g_cpu = atoi(optarg);
+				break;
+
+			case 'r':
+				g_realtime = atoi(optarg);
+				break;
+
+			case 'W':
+				g_workers = atoi(optarg);
+				break;
 #endif
 			case 't':
 				g_timeout = atoi(optarg) * 100;
 				break;
 
+			case 'y':
+				g_max_staleness = atoi(optarg);
+				break;
+
+			case 'm':
+				num = atol(optarg);
+				if (num <= 0) {
+					lprintf(LOG_ERR, "Invalid maximum number of TCP clients %s\n", optarg);
+					exit(EXIT_ARGS);
+				}
+				g_tcp_max_clients = num;
+				break;
+
+			case 'T':
+				g_tcp_idle_timeout = atoi(optarg);
+				break;
+#ifdef CONFIG_ENABLE_IO_URING
+			case 'U':
+				g_io_uring = 1;
+				break;
+#endif
+
 			case 'a':
 				g_auth = 1;
 				break;
@@ -483,21 +1380,38 @@ int main(int argc, char *argv[])
 		g_location = strdup("");
 	if (!g_contact)
 		g_contact = strdup("");
-
-	/* Store the starting time since we need it for MIB updates */
-	if (gettimeofday(&tv_last, NULL) == -1) {
-		memset(&tv_last, 0, sizeof(tv_last));
-		memset(&tv_sleep, 0, sizeof(tv_sleep));
-	} else {
-		tv_sleep.tv_sec = g_timeout / 100;
-		tv_sleep.tv_usec = (g_timeout % 100) * 10000;
+#ifdef __linux__
+	if (g_cpu >= CPU_SETSIZE) {
+		lprintf(LOG_ERR, "Invalid CPU %d\n", g_cpu);
+		exit(EXIT_ARGS);
 	}
+	if (g_realtime && (g_realtime < sched_get_priority_min(SCHED_FIFO) ||
+			   g_realtime > sched_get_priority_max(SCHED_FIFO))) {
+		lprintf(LOG_ERR, "Invalid SCHED_FIFO priority %d\n", g_realtime);
+		exit(EXIT_ARGS);
+	}
+#endif
+
+	/* Start counting sysUpTime */
+	get_process_uptime();
+
+#ifdef __linux__
+	/* Track the links, and with auto-discovery the interface list, before building the MIB */
+	m_netlink_fd = netlink_open();
+	if (m_netlink_fd == -1 && g_interface_auto)
+		exit(EXIT_SYSCALL);
+
+	/* Only reread the mount table when it changes */
+	m_mounts_fd = mounts_open();
+#endif
 
 	/* Build the MIB and execute the first MIB update to get actual values */
 	if (mib_build() == -1)
 		exit(EXIT_SYSCALL);
-	if (mib_update(1) == -1)
-		exit(EXIT_SYSCALL);
+	for (c = 0; c < MIB_REFRESH_MAX; c++) {
+		if (mib_update(c) == -1)
+			exit(EXIT_SYSCALL);
+	}
 
 #ifdef DEBUG
 	dump_mib(g_mib, g_mib_length);
@@ -537,6 +1451,11 @@ int main(int argc, char *argv[])
 		}
 	}
 #endif
+	udp_socket_setup(g_udp_sockfd);
+#ifdef __linux__
+	if (g_low_latency)
+		low_latency_socket(g_udp_sockfd);
+#endif
 
 	/* Open the server's TCP port and prepare it for listening */
 	g_tcp_sockfd = socket((g_family == AF_INET) ? PF_INET : PF_INET6, SOCK_STREAM, 0);
@@ -584,6 +1503,12 @@ int main(int argc, char *argv[])
 		exit(EXIT_SYSCALL);
 	}
 
+	/* Never block in accept() if the peer gives up before we get to it */
+	if (fcntl(g_tcp_sockfd, F_SETFL, fcntl(g_tcp_sockfd, F_GETFL) | O_NONBLOCK) == -1) {
+		lprintf(LOG_ERR, "could not set TCP socket non-blocking: %m\n");
+		exit(EXIT_SYSCALL);
+	}
+
 	/* Print a starting message (so the user knows the args were ok) */
 	if (g_bind_to_device) {
 		lprintf(LOG_INFO, "Listening on port %d/udp and %d/tcp on interface %s\n",
@@ -592,86 +1517,85 @@ int main(int argc, char *argv[])
 		lprintf(LOG_INFO, "Listening on port %d/udp and %d/tcp\n", g_udp_port, g_tcp_port);
 	}
 
-	/* Handle incoming connect requests and incoming data */
-	while (!g_quit) {
-		/* Sleep until we get a request or the timeout is over */
-		FD_ZERO(&rfds);
-		FD_ZERO(&wfds);
-		FD_SET(g_udp_sockfd, &rfds);
-		FD_SET(g_tcp_sockfd, &rfds);
-		nfds = (g_udp_sockfd > g_tcp_sockfd) ? g_udp_sockfd : g_tcp_sockfd;
-
-		for (i = 0; i < g_tcp_client_list_length; i++) {
-			if (g_tcp_client_list[i]->outgoing)
-				FD_SET(g_tcp_client_list[i]->sockfd, &wfds);
-			else
-				FD_SET(g_tcp_client_list[i]->sockfd, &rfds);
-
-			if (nfds < g_tcp_client_list[i]->sockfd)
-				nfds = g_tcp_client_list[i]->sockfd;
-		}
-
-		if (select(nfds + 1, &rfds, &wfds, NULL, &tv_sleep) == -1) {
-			if (g_quit)
-				break;
+	/* Register the sockets and the MIB refresh timers with the event loop */
+	m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (m_epoll_fd == -1) {
+		lprintf(LOG_ERR, "could not create event loop: %m\n");
+		exit(EXIT_SYSCALL);
+	}
 
-			lprintf(LOG_ERR, "could not select from sockets: %m\n");
+#ifdef __linux__
+	/* Hand the requests to protocol workers, see worker.c */
+	if (g_workers > 0) {
+		m_worker_fd = worker_start(g_workers);
+		if (m_worker_fd == -1 || event_add(m_worker_fd, EPOLLIN, EV_WORKERS) == -1)
 			exit(EXIT_SYSCALL);
+		lprintf(LOG_INFO, "Handling requests with %d workers\n", g_workers);
+#ifdef CONFIG_ENABLE_IO_URING
+		if (g_io_uring) {
+			lprintf(LOG_WARNING, "Not using io_uring with workers\n");
+			g_io_uring = 0;
 		}
-
-		/* Determine whether to update the MIB and the next ticks to sleep */
-		ticks = ticks_since(&tv_last, &tv_now);
-		if (ticks < 0 || ticks >= g_timeout) {
-			lprintf(LOG_DEBUG, "updating the MIB (full)\n");
-			if (mib_update(1) == -1)
-				exit(EXIT_SYSCALL);
-
-			memcpy(&tv_last, &tv_now, sizeof(tv_now));
-			tv_sleep.tv_sec = g_timeout / 100;
-			tv_sleep.tv_usec = (g_timeout % 100) * 10000;
-		} else {
-			lprintf(LOG_DEBUG, "updating the MIB (partial)\n");
-			if (mib_update(0) == -1)
-				exit(EXIT_SYSCALL);
-
-			tv_sleep.tv_sec = (g_timeout - ticks) / 100;
-			tv_sleep.tv_usec = ((g_timeout - ticks) % 100) * 10000;
-		}
-
-#ifdef DEBUG
-		dump_mib(g_mib, g_mib_length);
+#endif
+	}
+#endif
+#ifdef CONFIG_ENABLE_IO_URING
+	/* The ring takes over the sockets and waits on everything else through epoll */
+	if (g_io_uring && uring_open(m_epoll_fd) == 0) {
+		lprintf(LOG_INFO, "Serving UDP and TCP with io_uring\n");
+		m_uring = 1;
+	}
+#endif
+	if (!m_uring && (event_add(g_udp_sockfd, EPOLLIN, EV_UDP) == -1 ||
+			 event_add(g_tcp_sockfd, EPOLLIN, EV_TCP) == -1))
+		exit(EXIT_SYSCALL);
+#ifdef __linux__
+	if (m_netlink_fd != -1 && event_add(m_netlink_fd, EPOLLIN, EV_NETLINK) == -1)
+		exit(EXIT_SYSCALL);
+	if (m_mounts_fd != -1 && event_add(m_mounts_fd, EPOLLPRI, EV_MOUNTS) == -1)
+		exit(EXIT_SYSCALL);
 #endif
 
-		/* Handle UDP packets, TCP packets and TCP connection connects */
-		if (FD_ISSET(g_udp_sockfd, &rfds))
-			handle_udp_client();
-
-		if (FD_ISSET(g_tcp_sockfd, &rfds))
-			handle_tcp_connect();
+	for (c = 0; c < MIB_REFRESH_MAX; c++) {
+		if (timer_create_refresh(c) == -1)
+			exit(EXIT_SYSCALL);
+	}
 
-		for (i = 0; i < g_tcp_client_list_length; i++) {
-			if (g_tcp_client_list[i]->outgoing) {
-				if (FD_ISSET(g_tcp_client_list[i]->sockfd, &wfds))
-					handle_tcp_client_write(g_tcp_client_list[i]);
-			} else {
-				if (FD_ISSET(g_tcp_client_list[i]->sockfd, &rfds))
-					handle_tcp_client_read(g_tcp_client_list[i]);
-			}
-		}
+#ifdef __linux__
+	low_latency_setup();
+#endif
 
-		/* If there was a TCP disconnect, remove the client from the list */
-		for (i = 0; i < g_tcp_client_list_length; i++) {
-			if (g_tcp_client_list[i]->sockfd == -1) {
-				g_tcp_client_list_length--;
-				if (i < g_tcp_client_list_length) {
-					size_t len = (g_tcp_client_list_length - i) * sizeof(g_tcp_client_list[i]);
+	/* Handle incoming connect requests, incoming data and MIB refreshes */
+#ifdef CONFIG_ENABLE_IO_URING
+	if (m_uring) {
+		while (!g_quit) {
+			rc = uring_wait(g_tcp_idle_timeout > 0 ? 1000 : -1);
+			if (rc == -1)
+				exit(EXIT_SYSCALL);
 
-					free(g_tcp_client_list[i]);
-					memmove(&g_tcp_client_list[i], &g_tcp_client_list[i + 1], len);
-				}
-			}
+			if (rc & URING_EV_EPOLL)
+				handle_events(0);
+			handle_uring_accepted();
+			handle_schedule();
+			handle_idle_clients();
 		}
 	}
+#endif
+#ifdef __linux__
+	while (!g_quit && g_workers > 0) {
+		/* Do not block with responses to send */
+		handle_events(worker_sleep() ? (g_tcp_idle_timeout > 0 ? 1000 : -1) : 0);
+		handle_workers();
+		handle_schedule();
+		handle_idle_clients();
+	}
+#endif
+	while (!g_quit) {
+		/* Wake up regularly to expire idle clients, if enabled */
+		handle_events(g_tcp_idle_timeout > 0 ? 1000 : -1);
+		handle_schedule();
+		handle_idle_clients();
+	}
 
 	/* We were killed, print a message and exit */
 	lprintf(LOG_INFO, "stopped\n");
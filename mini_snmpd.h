@@ -19,6 +19,7 @@
 #include <stdint.h>
 #include <syslog.h>
 #include <sys/types.h>
+#include <time.h>
 #include <netinet/in.h>
 
 
@@ -34,11 +35,14 @@
 #define MAX_NR_OIDS                                     16
 #define MAX_NR_SUBIDS                                   16
 #define MAX_NR_DISKS                                    4
-#define MAX_NR_INTERFACES                               8
+#define MAX_NR_INTERFACES                               32
 #define MAX_NR_VALUES                                   192
+#define MAX_NR_DISKIO                                   256
 
 #define MAX_PACKET_SIZE                                 2048
 #define MAX_STRING_SIZE                                 64
+#define MAX_TCP_BUFFER_SIZE                             (4 * MAX_PACKET_SIZE)
+#define MAX_DYNAMIC_SIZE                                (sizeof(unsigned int) + 3)
 
 /*
  * SNMP dependent defines
@@ -54,6 +58,7 @@
 #define BER_TYPE_COUNTER                                0x41
 #define BER_TYPE_GAUGE                                  0x42
 #define BER_TYPE_TIME_TICKS                             0x43
+#define BER_TYPE_COUNTER64                              0x46
 #define BER_TYPE_NO_SUCH_OBJECT                         0x80
 #define BER_TYPE_NO_SUCH_INSTANCE                       0x81
 #define BER_TYPE_END_OF_MIB_VIEW                        0x82
@@ -140,6 +145,29 @@
 #endif/* CONFIG_ENABLE_IPV6 */
 
 
+/*
+ * MIB refresh classes, one per collector, each refreshed by its own timer
+ */
+enum {
+	MIB_REFRESH_NET = 0,
+#ifdef __linux__
+	MIB_REFRESH_WIRELESS,
+#endif
+	MIB_REFRESH_MEM,
+	MIB_REFRESH_DISK,
+#ifdef __linux__
+	MIB_REFRESH_DISKIO,
+#endif
+	MIB_REFRESH_LOAD,
+	MIB_REFRESH_CPU,
+	MIB_REFRESH_AGENT,
+#ifdef CONFIG_ENABLE_DEMO
+	MIB_REFRESH_DEMO,
+#endif
+	MIB_REFRESH_MAX
+};
+
+
 /*
  * Data types
  */
@@ -152,14 +180,53 @@ typedef struct client_s {
 	unsigned char       packet[MAX_PACKET_SIZE];
 	size_t              size;
 	int                 outgoing;
+
+	/* UDP only: request hash, 0 unless remembered, see dedup.c */
+	uint64_t            hash;
+
+	/* TCP only: stream buffers, input may hold several pipelined requests */
+	unsigned char      *rbuf;
+	size_t              rlen;
+	unsigned char      *wbuf;
+	size_t              wlen;
+	size_t              wpos;
+
+	/* TCP only: event loop interest and client pool linkage, see client.c */
+	uint32_t            events;
+	struct client_s    *prev;
+	struct client_s    *next;
+	time_t              queued;
+
+	/* TCP only: requests with the protocol workers, and reuse count */
+	size_t              inflight;
+	unsigned int        gen;
 } client_t;
 
+/* A request handed to a protocol worker, the response comes back in it */
+typedef struct job_s {
+	client_t             client;
+	struct my_sockaddr_t peer;	/* UDP only */
+	my_socklen_t         peerlen;
+	client_t            *owner;	/* TCP only, the connection ... */
+	unsigned int         gen;	/* ... unless reused since */
+	struct job_s        *next;
+} job_t;
+
 typedef struct oid_s {
 	unsigned int subid_list[MAX_NR_SUBIDS];
 	size_t       subid_list_length;
 	short        encoded_length;
 } oid_t;
 
+/*
+ * The OIDs of the virtual column of the changes MIB, .2.N.<OID>, do not fit
+ * subid_list.  They are kept as { OID_CHANGES, N, <OID> } instead, and only
+ * expanded to their OID_CHANGES_PREFIX subids when encoded, see mib.c.
+ */
+#define OID_CHANGES                                     0xFFFFFFFFu
+#define OID_CHANGES_PREFIX                              10
+#define MAX_NR_OID_SUBIDS                               (MAX_NR_SUBIDS - 2 + OID_CHANGES_PREFIX)
+
 typedef struct data_s {
 	unsigned char *buffer;
 	size_t         max_length;
@@ -169,15 +236,44 @@ typedef struct data_s {
 typedef struct value_s {
 	oid_t  oid;
 	data_t data;
+
+	/* The BER encoded OID, NULL unless the value is in the MIB */
+	const unsigned char *encoded_oid;
+
+	/* Optional, for volatile values computed only when encoded */
+	unsigned int (*get)(void);
+
+	/* The MIB generation the value last changed in, see mib_update() */
+	unsigned int gen;
 } value_t;
 
 typedef struct field_s {
 	char         *prefix;
 
 	size_t        len;
-	unsigned int *value[12];
+	void         *value[12];	/* unsigned int, or uint64_t if the parser is wide */
 } field_t;
 
+typedef struct field_slot_s {
+	uint16_t index;			/* in the field list + 1, 0 if unused */
+	uint16_t len;
+} field_slot_t;
+
+/* A parse_file() field set, compiled on first use, and its file kept open */
+typedef struct parser_s {
+	int           fd;
+	size_t        key;		/* words before the prefix on each line */
+	int           wide;		/* values are uint64_t */
+	uint32_t      signature;
+	size_t        mask;
+	field_slot_t *table;
+	char         *buf;		/* the file contents, grown to fit */
+	size_t        size;
+	size_t        lines;		/* in the file, at the last parse */
+} parser_t;
+
+#define PARSER_INIT { -1, 0, 0, 0, 0, NULL, NULL, 0, 0 }
+
 typedef struct request_s {
 	char      community[MAX_STRING_SIZE];
 	int       type;
@@ -187,6 +283,7 @@ typedef struct request_s {
 	uint32_t  max_repetitions;
 	oid_t     oid_list[MAX_NR_OIDS];
 	size_t    oid_list_length;
+	unsigned int classes;		/* MIB_REFRESH_* of the values served, as bits */
 } request_t;
 
 typedef struct response_s {
@@ -223,6 +320,7 @@ typedef struct diskinfo_s {
 	unsigned int used[MAX_NR_DISKS];
 	unsigned int blocks_used_percent[MAX_NR_DISKS];
 	unsigned int inodes_used_percent[MAX_NR_DISKS];
+	char device[MAX_NR_DISKS][MAX_STRING_SIZE];
 } diskinfo_t;
 
 typedef struct netinfo_s {
@@ -235,6 +333,7 @@ typedef struct netinfo_s {
 	unsigned int tx_packets[MAX_NR_INTERFACES];
 	unsigned int tx_errors[MAX_NR_INTERFACES];
 	unsigned int tx_drops[MAX_NR_INTERFACES];
+	unsigned int last_change[MAX_NR_INTERFACES];
 	char mac_addr[MAX_NR_INTERFACES][6];
 } netinfo_t;
 
@@ -245,6 +344,44 @@ typedef struct wirelessinfo_s {
 } wirelessinfo_t;
 #endif
 
+#ifdef __linux__
+typedef struct diskioinfo_s {
+	unsigned int nread[MAX_NR_DISKIO];
+	unsigned int nwritten[MAX_NR_DISKIO];
+	unsigned int reads[MAX_NR_DISKIO];
+	unsigned int writes[MAX_NR_DISKIO];
+	uint64_t     nread_x[MAX_NR_DISKIO];
+	uint64_t     nwritten_x[MAX_NR_DISKIO];
+	uint64_t     busy_time[MAX_NR_DISKIO];
+} diskioinfo_t;
+#endif
+
+/* The agent's own counters, the UDP socket ones are sampled when refreshed */
+
+typedef struct agentinfo_s {
+	unsigned int in_pkts;
+	unsigned int in_bad_versions;
+	unsigned int in_bad_community_names;
+	unsigned int in_bad_community_uses;
+	unsigned int in_asn_parse_errs;
+	unsigned int silent_drops;
+
+	unsigned int dup_resends;	/* retransmissions answered from the cache */
+	unsigned int dup_drops;		/* ... and dropped, still being handled */
+	unsigned int shed_bulk;		/* GETBULKs dropped by admission control */
+	unsigned int shed_next;		/* ... and large GETNEXTs */
+	unsigned int bulk_truncated;	/* GETBULK responses cut short by the budget */
+
+	unsigned int udp_rcvbuf;
+	unsigned int udp_sndbuf;
+	unsigned int udp_drops;		/* cumulative, from SO_RXQ_OVFL */
+	unsigned int udp_queue;		/* bytes waiting in the receive queue */
+	unsigned int udp_queue_max;
+} agentinfo_t;
+
+/* The protocol counters are also counted by the protocol workers */
+#define AGENT_COUNT(field)	__atomic_fetch_add(&g_agent.field, 1, __ATOMIC_RELAXED)
+
 #ifdef CONFIG_ENABLE_DEMO
 typedef struct demoinfo_s {
 	unsigned int random_value_1;
@@ -283,21 +420,47 @@ extern char     *g_interface_list[MAX_NR_INTERFACES];
 extern size_t    g_interface_list_length;
 
 #ifdef __linux__
+extern int       g_interface_auto;
+
 extern char     *g_wireless_list[MAX_NR_INTERFACES];
 extern size_t    g_wireless_list_length;
+
+extern char     *g_diskio_list[MAX_NR_DISKIO];
+extern size_t    g_diskio_list_length;
+
+extern int       g_low_latency;
+extern int       g_cpu;
+extern int       g_realtime;
+extern int       g_workers;
 #endif
 
 extern in_port_t g_udp_port;
 extern in_port_t g_tcp_port;
 
 extern client_t  g_udp_client;
-extern client_t *g_tcp_client_list[MAX_NR_CLIENTS];
+extern client_t *g_tcp_client_list;
 extern size_t    g_tcp_client_list_length;
+extern size_t    g_tcp_max_clients;
+extern int       g_tcp_idle_timeout;
+#ifdef CONFIG_ENABLE_IO_URING
+extern int       g_io_uring;
+#endif
 
 extern int       g_udp_sockfd;
 extern int       g_tcp_sockfd;
-
-extern value_t   g_mib[MAX_NR_VALUES];
+extern int       g_udp_rcvbuf;
+extern int       g_udp_sndbuf;
+extern int       g_dedup_window;
+extern int       g_shed_watermark;
+extern int       g_udp_load;
+extern int       g_bulk_varbinds;
+extern int       g_bulk_bytes;
+extern int       g_bulk_time;
+extern int       g_max_staleness;
+
+extern agentinfo_t g_agent;
+
+extern value_t  *g_mib;
 extern size_t    g_mib_length;
 
 
@@ -315,21 +478,27 @@ int          oid_cmp  (const oid_t *oid1, const oid_t *oid2);
 
 int          split(const char *str, char *delim, char **list, int max_list_length);
 
-client_t    *find_oldest_client(void);
+client_t    *tcp_client_alloc   (void);
+void         tcp_client_free    (client_t *client);
+client_t    *tcp_client_oldest  (void);
+client_t    *tcp_client_expired (time_t when);
+
+unsigned char *tcp_buffer_get   (void);
+void         tcp_buffer_put     (unsigned char *buf);
 
 void        *allocate    (size_t len);
 
 int          read_config (char *file);
 
-int          parse_file  (char *file, field_t fields[]);
+int          parse_file  (parser_t *parser, char *file, field_t fields[]);
 int          read_file   (const char *filename, char *buffer, size_t size);
 
 unsigned int read_value  (const char *buffer, const char *prefix);
 void         read_values (const char *buffer, const char *prefix, unsigned int *values, int count);
 
-int          ticks_since (const struct timeval *tv_last, struct timeval *tv_now);
-
+unsigned int timespec_to_ticks  (const struct timespec *ts);
 unsigned int get_process_uptime (void);
+time_t       monotonic_time     (void);
 unsigned int get_system_uptime  (void);
 
 void         get_loadinfo       (loadinfo_t *loadinfo);
@@ -337,23 +506,72 @@ void         get_meminfo        (meminfo_t *meminfo);
 void         get_cpuinfo        (cpuinfo_t *cpuinfo);
 void         get_diskinfo       (diskinfo_t *diskinfo);
 void         get_netinfo        (netinfo_t *netinfo);
+void         get_agentinfo      (agentinfo_t *agentinfo);
+void         udp_drops_update   (struct msghdr *msg);
+void         udp_load_update    (int busy);
+
+int64_t      sched_now       (void);
+void         sched_polled    (unsigned int classes);
+unsigned int sched_changed   (void);
+void         sched_refreshed (int class, int64_t start);
+int64_t      sched_next      (int class);
+
+int          dedup_check (client_t *client);
+void         dedup_done  (const client_t *client);
 #ifdef __linux__
 void         get_wirelessinfo   (wirelessinfo_t *wirelessinfo);
+void         get_diskio_list    (void);
+void         get_diskioinfo     (diskioinfo_t *diskioinfo);
+int          diskio_changed     (void);
+
+int          mounts_open        (void);
+int          mounts_update      (void);
+
+int          netlink_open       (void);
+int          netlink_recv       (void);
 #endif
 #ifdef CONFIG_ENABLE_DEMO
 void         get_demoinfo       (demoinfo_t *demoinfo);
 #endif
 
-int snmp_packet_complete   (const client_t *client);
+#ifdef CONFIG_ENABLE_IO_URING
+#define URING_EV_EPOLL                                  1
+
+int          uring_open         (int epoll_fd);
+int          uring_wait         (int timeout);
+int          uring_accepted     (void);
+#endif
+
+int snmp_packet_complete   (const unsigned char *packet, size_t size);
+int snmp_admit             (const client_t *client);
 int snmp                   (      client_t *client);
 int snmp_element_as_string (const data_t *data, char *buffer, size_t size);
 
 int mib_build    (void);
-int mib_update   (int full);
+int mib_update   (int class);
+void mib_lock    (void);
+void mib_unlock  (void);
 
+#ifdef __linux__
+int    worker_start  (int num);
+job_t *worker_job    (void);
+void   worker_put    (job_t *job);
+int    worker_submit (job_t *job);
+job_t *worker_done   (void);
+int    worker_sleep  (void);
+int    worker_load   (void);
+#endif
+
+int      mib_class    (const value_t *value);
+value_t *mib_get      (const oid_t *oid);
 value_t *mib_find     (const oid_t *oid, size_t *pos);
 value_t *mib_findnext (const oid_t *oid);
 
+int                 mib_oid_compact (oid_t *oid);
+const unsigned int *mib_oid_subids  (const oid_t *oid, unsigned int *buf, size_t *num);
+
+const data_t *mib_value_data (const value_t *value, data_t *scratch);
+
 #endif /* MINI_SNMPD_H_ */
 
 /* vim: ts=4 sts=4 sw=4 nowrap
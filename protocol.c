@@ -19,6 +19,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <time.h>
 
 #include "mini_snmpd.h"
 
@@ -33,6 +34,8 @@
 	memcpy(&(resp)->value_list[len].oid, &(req)->oid_list[index],	\
 	       sizeof((req)->oid_list[index]));				\
 	memcpy(&(resp)->value_list[len].data, &err, sizeof(err));	\
+	(resp)->value_list[len].encoded_oid = NULL;			\
+	(resp)->value_list[len].get = NULL;				\
 	(resp)->value_list_length++;					\
 	continue;							\
 }
@@ -76,6 +79,7 @@ static int decode_len(const unsigned char *packet, size_t size, size_t *pos, int
 		case BER_TYPE_COUNTER:
 		case BER_TYPE_GAUGE:
 		case BER_TYPE_TIME_TICKS:
+		case BER_TYPE_COUNTER64:
 		case BER_TYPE_NO_SUCH_OBJECT:
 		case BER_TYPE_NO_SUCH_INSTANCE:
 		case BER_TYPE_END_OF_MIB_VIEW:
@@ -249,6 +253,9 @@ static int decode_oid(const unsigned char *packet, size_t size, size_t *pos, siz
 			}
 		}
 		value->subid_list_length++;
+
+		if (value->subid_list_length == OID_CHANGES_PREFIX)
+			mib_oid_compact(value);
 	}
 
 	return 0;
@@ -546,17 +553,20 @@ static int encode_snmp_sequence_header(unsigned char *buf, size_t len, int type)
 
 static int encode_snmp_oid(unsigned char *buf, const oid_t *oid)
 {
-	size_t i, len;
+	unsigned int buffer[MAX_NR_OID_SUBIDS];
+	const unsigned int *subids;
+	size_t i, num, len;
 
+	subids = mib_oid_subids(oid, buffer, &num);
 	len = 1;
-	for (i = 2; i < oid->subid_list_length; i++) {
-		if (oid->subid_list[i] >= (1 << 28))
+	for (i = 2; i < num; i++) {
+		if (subids[i] >= (1 << 28))
 			len += 5;
-		else if (oid->subid_list[i] >= (1 << 21))
+		else if (subids[i] >= (1 << 21))
 			len += 4;
-		else if (oid->subid_list[i] >= (1 << 14))
+		else if (subids[i] >= (1 << 14))
 			len += 3;
-		else if (oid->subid_list[i] >= (1 << 7))
+		else if (subids[i] >= (1 << 7))
 			len += 2;
 		else
 			len += 1;
@@ -579,24 +589,24 @@ static int encode_snmp_oid(unsigned char *buf, const oid_t *oid)
 		*buf++ = len & 0x7F;
 	}
 
-	*buf++ = oid->subid_list[0] * 40 + oid->subid_list[1];
-	for (i = 2; i < oid->subid_list_length; i++) {
-		if (oid->subid_list[i] >= (1 << 28))
+	*buf++ = subids[0] * 40 + subids[1];
+	for (i = 2; i < num; i++) {
+		if (subids[i] >= (1 << 28))
 			len = 5;
-		else if (oid->subid_list[i] >= (1 << 21))
+		else if (subids[i] >= (1 << 21))
 			len = 4;
-		else if (oid->subid_list[i] >= (1 << 14))
+		else if (subids[i] >= (1 << 14))
 			len = 3;
-		else if (oid->subid_list[i] >= (1 << 7))
+		else if (subids[i] >= (1 << 7))
 			len = 2;
 		else
 			len = 1;
 
 		while (len--) {
 			if (len)
-				*buf++ = ((oid->subid_list[i] >> (7 * len)) & 0x7F) | 0x80;
+				*buf++ = ((subids[i] >> (7 * len)) & 0x7F) | 0x80;
 			else
-				*buf++ = (oid->subid_list[i] >> (7 * len)) & 0x7F;
+				*buf++ = (subids[i] >> (7 * len)) & 0x7F;
 		}
 	}
 
@@ -612,13 +622,20 @@ static int log_encoding_error(const char *what, const char *why)
 static int encode_snmp_varbind(unsigned char *buf, size_t *pos, const value_t *value)
 {
 	size_t len;
+	unsigned char tmp[MAX_DYNAMIC_SIZE];
+	data_t scratch = { tmp, sizeof(tmp), 0 };
+	const data_t *data;
 
 	/* The value of the variable binding (NULL for error responses) */
-	len = value->data.encoded_length;
+	data = mib_value_data(value, &scratch);
+	if (!data)
+		return log_encoding_error(oid_ntoa(&value->oid), "DATA invalid");
+
+	len = data->encoded_length;
 	if (*pos < len)
 		return log_encoding_error(oid_ntoa(&value->oid), "DATA overflow");
 
-	memcpy(&buf[*pos - len], value->data.buffer, len);
+	memcpy(&buf[*pos - len], data->buffer, len);
 	*pos = *pos - len;
 
 	/* The OID of the variable binding */
@@ -626,15 +643,18 @@ static int encode_snmp_varbind(unsigned char *buf, size_t *pos, const value_t *v
 	if (*pos < len)
 		return log_encoding_error(oid_ntoa(&value->oid), "OID overflow");
 
-	encode_snmp_oid(&buf[*pos - len], &value->oid);
+	if (value->encoded_oid)
+		memcpy(&buf[*pos - len], value->encoded_oid, len);
+	else
+		encode_snmp_oid(&buf[*pos - len], &value->oid);
 	*pos = *pos - len;
 
 	/* The sequence header (type and length) of the variable binding */
-	len = get_hdrlen(value->oid.encoded_length + value->data.encoded_length);
+	len = get_hdrlen(value->oid.encoded_length + data->encoded_length);
 	if (*pos < len)
 		return log_encoding_error(oid_ntoa(&value->oid), "VARBIND overflow");
 
-	encode_snmp_sequence_header(&buf[*pos - len], value->oid.encoded_length + value->data.encoded_length, BER_TYPE_SEQUENCE);
+	encode_snmp_sequence_header(&buf[*pos - len], value->oid.encoded_length + data->encoded_length, BER_TYPE_SEQUENCE);
 	*pos = *pos - len;
 
 	return 0;
@@ -654,6 +674,8 @@ static int encode_snmp_response(request_t *request, response_t *response, client
 		for (i = 0; i < request->oid_list_length; i++) {
 			memcpy(&response->value_list[i].oid, &request->oid_list[i], sizeof(request->oid_list[i]));
 			memcpy(&response->value_list[i].data, &m_null, sizeof(m_null));
+			response->value_list[i].encoded_oid = NULL;
+			response->value_list[i].get = NULL;
 		}
 		response->value_list_length = request->oid_list_length;
 	}
@@ -742,6 +764,15 @@ static int encode_snmp_response(request_t *request, response_t *response, client
 	return 0;
 }
 
+/* Note the refresh class of a value served, for the scheduler */
+static void request_polled(request_t *request, const value_t *value)
+{
+	int class = mib_class(value);
+
+	if (class >= 0)
+		request->classes |= 1u << class;
+}
+
 static int handle_snmp_get(request_t *request, response_t *response, client_t *UNUSED(client))
 {
 	size_t i, pos;
@@ -749,25 +780,26 @@ static int handle_snmp_get(request_t *request, response_t *response, client_t *U
 	const char *msg = "Failed handling SNMP GET: value list overflow\n";
 
 	/*
-	 * Search each varbinding of the request and append the value to the
-	 * response. Note that if the length does not match, we might have found a
-	 * subid of the requested one (table cell of table column)!
+	 * Look up each varbinding of the request and append the value to the
+	 * response. If there is no such instance, the ordered MIB tells whether
+	 * we might have found a subid of the requested one (table cell of table
+	 * column) instead!
 	 */
 	for (i = 0; i < request->oid_list_length; i++) {
-		pos = 0;
-		value = mib_find(&request->oid_list[i], &pos);
-		if (!value)
-			SNMP_GET_ERROR(response, request, i, SNMP_STATUS_NO_SUCH_NAME, m_no_such_object, msg);
+		value = mib_get(&request->oid_list[i]);
+		if (!value) {
+			value = mib_find(&request->oid_list[i], &pos);
+			if (value && value->oid.subid_list_length == (request->oid_list[i].subid_list_length + 1))
+				SNMP_GET_ERROR(response, request, i, SNMP_STATUS_NO_SUCH_NAME, m_no_such_instance, msg);
 
-		if (pos >= g_mib_length)
 			SNMP_GET_ERROR(response, request, i, SNMP_STATUS_NO_SUCH_NAME, m_no_such_object, msg);
+		}
 
-		if (value->oid.subid_list_length == (request->oid_list[i].subid_list_length + 1))
-			SNMP_GET_ERROR(response, request, i, SNMP_STATUS_NO_SUCH_NAME, m_no_such_instance, msg);
-
-		if (value->oid.subid_list_length != request->oid_list[i].subid_list_length)
+		/* SNMPv1 cannot carry Counter64 values (RFC 3584) */
+		if (request->version == SNMP_VERSION_1 && value->data.buffer[0] == BER_TYPE_COUNTER64)
 			SNMP_GET_ERROR(response, request, i, SNMP_STATUS_NO_SUCH_NAME, m_no_such_object, msg);
 
+		request_polled(request, value);
 		if (response->value_list_length < MAX_NR_VALUES) {
 			memcpy(&response->value_list[response->value_list_length], value, sizeof(*value));
 			response->value_list_length++;
@@ -794,9 +826,14 @@ static int handle_snmp_getnext(request_t *request, response_t *response, client_
 	 */
 	for (i = 0; i < request->oid_list_length; i++) {
 		value = mib_findnext(&request->oid_list[i]);
+
+		/* SNMPv1 skips Counter64 values (RFC 3584) */
+		while (value && request->version == SNMP_VERSION_1 && value->data.buffer[0] == BER_TYPE_COUNTER64)
+			value = mib_findnext(&value->oid);
 		if (!value)
 			SNMP_GET_ERROR(response, request, i, SNMP_STATUS_NO_SUCH_NAME, m_end_of_mib_view, msg);
 
+		request_polled(request, value);
 		if (response->value_list_length < MAX_NR_VALUES) {
 			memcpy(&response->value_list[response->value_list_length], value, sizeof(*value));
 			response->value_list_length++;
@@ -816,15 +853,86 @@ static int handle_snmp_set(request_t *request, response_t *response, client_t *U
 			     ? SNMP_STATUS_NO_SUCH_NAME : SNMP_STATUS_NO_ACCESS, 0);
 }
 
+/*
+ * The work a GETBULK may do: varbinds, encoded bytes and time.  Once it is
+ * spent the response is cut short, as RFC 3416 allows, so one request with
+ * a huge max-repetitions cannot hold up all others.
+ */
+typedef struct {
+	size_t          varbinds;
+	size_t          bytes;
+	size_t          count;
+	struct timespec deadline;
+} budget_t;
+
+static void budget_init(budget_t *budget, const request_t *request)
+{
+	size_t overhead;
+
+	/* What the response needs besides the varbinds, the headers at their largest */
+	overhead = 3 * get_hdrlen(MAX_PACKET_SIZE) + get_intlen(request->version) +
+		get_strlen(request->community) + get_intlen(request->id) + 2 * get_intlen(MAX_NR_OIDS);
+
+	budget->varbinds = MAX_NR_VALUES;
+	if (g_bulk_varbinds > 0 && (size_t)g_bulk_varbinds < budget->varbinds)
+		budget->varbinds = g_bulk_varbinds;
+
+	budget->bytes = MAX_PACKET_SIZE > overhead ? MAX_PACKET_SIZE - overhead : 0;
+	if (g_bulk_bytes > 0 && (size_t)g_bulk_bytes < budget->bytes)
+		budget->bytes = g_bulk_bytes;
+
+	budget->count = 0;
+	if (g_bulk_time > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &budget->deadline);
+		budget->deadline.tv_sec  += g_bulk_time / 1000;
+		budget->deadline.tv_nsec += (g_bulk_time % 1000) * 1000000;
+		if (budget->deadline.tv_nsec >= 1000000000) {
+			budget->deadline.tv_sec++;
+			budget->deadline.tv_nsec -= 1000000000;
+		}
+	}
+}
+
+/* Take the next varbind, @value or endOfMibView for @oid, out of the budget */
+static int budget_spend(budget_t *budget, const value_t *value, const oid_t *oid)
+{
+	struct timespec now;
+	size_t len;
+
+	if (value)
+		len = value->oid.encoded_length + (value->get ? MAX_DYNAMIC_SIZE : (size_t)value->data.encoded_length);
+	else
+		len = oid->encoded_length + m_end_of_mib_view.encoded_length;
+	len += get_hdrlen(len);
+
+	if (budget->varbinds == 0 || len > budget->bytes)
+		return -1;
+
+	/* The clock is only read every few varbinds */
+	if (g_bulk_time > 0 && ++budget->count % 16 == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec > budget->deadline.tv_sec ||
+		    (now.tv_sec == budget->deadline.tv_sec && now.tv_nsec >= budget->deadline.tv_nsec))
+			return -1;
+	}
+
+	budget->varbinds--;
+	budget->bytes -= len;
+
+	return 0;
+}
+
 static int handle_snmp_getbulk(request_t *request, response_t *response, client_t *UNUSED(client))
 {
 	size_t i, j;
 	oid_t oid_list[MAX_NR_OIDS];
 	value_t *value;
+	budget_t budget;
 	const char *msg = "Failed handling SNMP GETBULK: value list overflow\n";
 
 	/* Make a local copy of the OID list since we are going to modify it */
 	memcpy(oid_list, request->oid_list, sizeof(request->oid_list));
+	budget_init(&budget, request);
 
 	/* The non-repeaters are handled like with the GETNEXT request */
 	for (i = 0; i < request->oid_list_length; i++) {
@@ -832,9 +940,12 @@ static int handle_snmp_getbulk(request_t *request, response_t *response, client_
 			break;
 
 		value = mib_findnext(&oid_list[i]);
+		if (budget_spend(&budget, value, &request->oid_list[i]))
+			goto truncated;
 		if (!value)
 			SNMP_GET_ERROR(response, request, i, SNMP_STATUS_NO_SUCH_NAME, m_end_of_mib_view, msg);
 
+		request_polled(request, value);
 		if (response->value_list_length < MAX_NR_VALUES) {
 			memcpy(&response->value_list[response->value_list_length], value, sizeof(*value));
 			response->value_list_length++;
@@ -860,9 +971,12 @@ static int handle_snmp_getbulk(request_t *request, response_t *response, client_
 
 		for (i = request->non_repeaters; i < request->oid_list_length; i++) {
 			value = mib_findnext(&oid_list[i]);
+			if (budget_spend(&budget, value, &request->oid_list[i]))
+				goto truncated;
 			if (!value)
 				SNMP_GET_ERROR(response, request, i, SNMP_STATUS_NO_SUCH_NAME, m_end_of_mib_view, msg);
 
+			request_polled(request, value);
 			if (response->value_list_length < MAX_NR_VALUES) {
 				memcpy(&response->value_list[response->value_list_length], value, sizeof(*value));
 				response->value_list_length++;
@@ -880,10 +994,14 @@ static int handle_snmp_getbulk(request_t *request, response_t *response, client_
 	}
 
 	return 0;
+
+truncated:
+	AGENT_COUNT(bulk_truncated);
+	return 0;
 }
 
 
-int snmp_packet_complete(const client_t *client)
+int snmp_packet_complete(const unsigned char *packet, size_t size)
 {
 	int type;
 	size_t pos = 0, len = 0;
@@ -893,21 +1011,83 @@ int snmp_packet_complete(const client_t *client)
 	 * version, community, sequence, request id, 2 integers, sequence, oid
 	 * and null value.
 	 */
-	if (client->size < 25)
+	if (size < 25)
 		return 0;
 
 	/* The SNMP message is enclosed in a sequence */
-	if (decode_len(client->packet, client->size, &pos, &type, &len) == -1)
+	if (decode_len(packet, size, &pos, &type, &len) == -1)
 		return -1;
 
-	if (type != BER_TYPE_SEQUENCE || len < 1 || len > (client->size - pos)) {
+	if (type != BER_TYPE_SEQUENCE || len < 1 || pos + len > MAX_PACKET_SIZE) {
 		lprintf(LOG_DEBUG, "Unexpected SNMP header type %02X length %zu\n", type, len);
 		errno = EINVAL;
 		return -1;
 	}
 
-	/* Return whether we received the whole packet */
-	return ((client->size - pos) == len) ? 1 : 0;
+	/*
+	 * Return the length of the first message once it has been received in
+	 * full, the stream may already contain the start of the next message.
+	 */
+	if ((size - pos) < len)
+		return 0;
+
+	return pos + len;
+}
+
+/*
+ * Admission control ahead of snmp(), returns -1 if the UDP request should
+ * be dropped.  While the backlog is above the watermark GETBULKs, and
+ * GETNEXTs of more than SHED_GETNEXT_MAX varbinds, are shed, so GETs, the
+ * liveness checks, are still answered in time.  Malformed requests are
+ * left to snmp().
+ */
+#define SHED_GETNEXT_MAX                                4
+
+int snmp_admit(const client_t *client)
+{
+	const unsigned char *packet = client->packet;
+	size_t size = client->size;
+	size_t pos = 0, len = 0, end;
+	int i, type;
+
+	if (g_shed_watermark <= 0 || g_udp_load < g_shed_watermark)
+		return 0;
+
+	/* Message sequence, then skip the version and the community */
+	if (decode_len(packet, size, &pos, &type, &len) == -1 || type != BER_TYPE_SEQUENCE)
+		return 0;
+	for (i = 0; i < 2; i++) {
+		if (decode_len(packet, size, &pos, &type, &len) == -1 || decode_ptr(packet, size, &pos, len) == -1)
+			return 0;
+	}
+
+	if (decode_len(packet, size, &pos, &type, &len) == -1)
+		return 0;
+	if (type == BER_TYPE_SNMP_GETBULK) {
+		AGENT_COUNT(shed_bulk);
+		return -1;
+	}
+	if (type != BER_TYPE_SNMP_GETNEXT)
+		return 0;
+
+	/* Skip the request id, error status and index, count the varbinds */
+	for (i = 0; i < 3; i++) {
+		if (decode_len(packet, size, &pos, &type, &len) == -1 || decode_ptr(packet, size, &pos, len) == -1)
+			return 0;
+	}
+	if (decode_len(packet, size, &pos, &type, &len) == -1 || type != BER_TYPE_SEQUENCE)
+		return 0;
+
+	end = pos + len;
+	for (i = 0; pos < end && i <= SHED_GETNEXT_MAX; i++) {
+		if (decode_len(packet, size, &pos, &type, &len) == -1 || decode_ptr(packet, size, &pos, len) == -1)
+			return 0;
+	}
+	if (i <= SHED_GETNEXT_MAX)
+		return 0;
+
+	AGENT_COUNT(shed_next);
+	return -1;
 }
 
 int snmp(client_t *client)
@@ -920,8 +1100,14 @@ int snmp(client_t *client)
 	memset(&response, 0, sizeof(response));
 
 	/* Decode the request (only checks for syntax of the packet) */
-	if (decode_snmp_request(&request, client) == -1)
+	AGENT_COUNT(in_pkts);
+	if (decode_snmp_request(&request, client) == -1) {
+		if (request.version != SNMP_VERSION_1 && request.version != SNMP_VERSION_2C)
+			AGENT_COUNT(in_bad_versions);
+		else
+			AGENT_COUNT(in_asn_parse_errs);
 		return -1;
+	}
 
 	/*
 	 * If we are using SNMP v2c or require authentication, check the community
@@ -929,11 +1115,13 @@ int snmp(client_t *client)
 	 */
 	if (request.version == SNMP_VERSION_2C) {
 		if (strcmp(g_community, request.community)) {
+			AGENT_COUNT(in_bad_community_names);
 			response.error_status = (request.version == SNMP_VERSION_2C) ? SNMP_STATUS_NO_ACCESS : SNMP_STATUS_GEN_ERR;
 			response.error_index = 0;
 			goto done;
 		}
 	} else if (g_auth) {
+		AGENT_COUNT(in_bad_community_uses);
 		response.error_status = SNMP_STATUS_GEN_ERR;
 		response.error_index = 0;
 		goto done;
@@ -963,10 +1151,13 @@ int snmp(client_t *client)
 
 		default:
 			lprintf(LOG_ERR, "UNHANDLED REQUEST TYPE %d\n", request.type);
+			AGENT_COUNT(silent_drops);
 			client->size = 0;
 			return 0;
 	}
 
+	sched_polled(request.classes);
+
 done:
 	/* Encode the request (depending on error status and encode flags) */
 	if (encode_snmp_response(&request, &response, client) == -1)
@@ -982,6 +1173,7 @@ int snmp_element_as_string(const data_t *data, char *buf, size_t size)
 	int type, val;
 	oid_t oid;
 	unsigned int cnt;
+	unsigned long long cnt64 = 0;
 
 	/* Decode the element type and length */
 	if (decode_len(data->buffer, data->encoded_length, &pos, &type, &len) == -1)
@@ -1013,6 +1205,14 @@ int snmp_element_as_string(const data_t *data, char *buf, size_t size)
 			snprintf(buf, size, "%u", cnt);
 			break;
 
+		case BER_TYPE_COUNTER64:
+			if (pos + len > (size_t)data->encoded_length)
+				return -1;
+			for (i = 0; i < len; i++)
+				cnt64 = (cnt64 << 8) | data->buffer[pos + i];
+			snprintf(buf, size, "%llu", cnt64);
+			break;
+
 		case BER_TYPE_NO_SUCH_OBJECT:
 			snprintf(buf, size, "noSuchObject");
 			break;
@@ -0,0 +1,142 @@
+/* Adaptive MIB refresh scheduling, following the managers' poll cadence
+ *
+ * This file may be distributed and/or modified under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation and appearing in the file LICENSE.GPL included in the
+ * packaging of this file.
+ *
+ * This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+ * WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * See COPYING for GPL licensing information.
+ */
+
+#include <sys/types.h>
+#include <string.h>
+#include <time.h>
+
+#include "mini_snmpd.h"
+
+/*
+ * With g_max_staleness set, each refresh class is no longer refreshed every
+ * g_timeout, but shortly before it is expected to be polled next.
+ *
+ * snmp() reports the classes of the values it serves.  A request after
+ * SCHED_QUIET ms without any for the class starts a poll, a walk is one
+ * poll however many requests it takes, and the time between the starts of
+ * two polls is averaged into the poll interval.  The refresh is scheduled
+ * the collector's own run time, and a margin, ahead of the next poll.
+ *
+ * A class not polled for a few intervals is idle and only refreshed every
+ * g_max_staleness seconds, which also bounds the age of the values served
+ * in any case.  Refreshes are never closer than g_timeout.
+ *
+ * All times are CLOCK_MONOTONIC milliseconds, the clock of the timers.
+ */
+#define SCHED_QUIET                                     1000
+#define SCHED_MARGIN                                    20
+#define SCHED_IDLE                                      3	/* intervals */
+
+typedef struct {
+	int64_t last;		/* last request, from any thread */
+	int64_t poll;		/* start of the last poll */
+	int64_t interval;	/* between polls, 0 until known */
+	int64_t cost;		/* of a refresh, event loop only */
+	int64_t refreshed;	/* end of the last refresh, event loop only */
+} sched_t;
+
+static sched_t      m_sched[MIB_REFRESH_MAX];
+static unsigned int m_changed;
+
+int64_t sched_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* The classes of the values a request was served, called by snmp() */
+void sched_polled(unsigned int classes)
+{
+	int64_t now, prev, poll, gap, interval;
+	int c;
+
+	if (g_max_staleness <= 0 || !classes)
+		return;
+
+	now = sched_now();
+	for (c = 0; c < MIB_REFRESH_MAX; c++) {
+		sched_t *sched = &m_sched[c];
+
+		if (!(classes & (1u << c)))
+			continue;
+
+		/* Only one thread sees the first request of a poll */
+		prev = __atomic_exchange_n(&sched->last, now, __ATOMIC_RELAXED);
+		if (now - prev < SCHED_QUIET)
+			continue;
+
+		/* A poll after a long absence does not tell the interval */
+		poll = __atomic_load_n(&sched->poll, __ATOMIC_RELAXED);
+		interval = __atomic_load_n(&sched->interval, __ATOMIC_RELAXED);
+		if (poll) {
+			gap = now - poll;
+			if (!interval)
+				interval = gap;
+			else if (gap <= SCHED_IDLE * interval)
+				interval = (3 * interval + gap) / 4;
+			__atomic_store_n(&sched->interval, interval, __ATOMIC_RELAXED);
+		}
+		__atomic_store_n(&sched->poll, now, __ATOMIC_RELAXED);
+
+		/* Have the event loop reschedule the class */
+		__atomic_fetch_or(&m_changed, 1u << c, __ATOMIC_RELAXED);
+	}
+}
+
+/* The classes whose poll cadence changed since the last call */
+unsigned int sched_changed(void)
+{
+	return __atomic_exchange_n(&m_changed, 0, __ATOMIC_RELAXED);
+}
+
+/* A refresh of @class, started at @start, is done */
+void sched_refreshed(int class, int64_t start)
+{
+	sched_t *sched = &m_sched[class];
+	int64_t now = sched_now();
+
+	sched->cost = sched->cost ? (3 * sched->cost + now - start) / 4 : now - start;
+	sched->refreshed = now;
+}
+
+/* When to refresh @class next */
+int64_t sched_next(int class)
+{
+	sched_t *sched = &m_sched[class];
+	int64_t now, last, poll, interval, target, next, min;
+
+	now      = sched_now();
+	last     = __atomic_load_n(&sched->last, __ATOMIC_RELAXED);
+	poll     = __atomic_load_n(&sched->poll, __ATOMIC_RELAXED);
+	interval = __atomic_load_n(&sched->interval, __ATOMIC_RELAXED);
+
+	min = g_timeout > 0 ? g_timeout * 10 : 10;
+	next = sched->refreshed + (int64_t)g_max_staleness * 1000;
+
+	/* Just before the next poll, the one after if too soon after the last refresh */
+	if (interval && now - last < SCHED_IDLE * interval) {
+		target = poll + interval - sched->cost - SCHED_MARGIN;
+		while (target < sched->refreshed + min || target < now)
+			target += interval;
+		if (target < next)
+			next = target;
+	}
+
+	return next > now ? next : now;
+}
+
+/* vim: ts=4 sts=4 sw=4 nowrap
+ */
@@ -0,0 +1,457 @@
+#!/usr/bin/env python3
+# Regression checks against a running agent
+#
+# Usage: walk.py [path/to/mini_snmpd]
+#
+# Starts the agent on free ports and talks to it with a raw BER client, so
+# that nothing besides Python is needed.  Each test_*() function covers one
+# feature, main() runs them against the agent in all its serving modes.
+
+import os
+import platform
+import socket
+import subprocess
+import sys
+import time
+
+GET, GETNEXT, RESPONSE, GETBULK = 0xa0, 0xa1, 0xa2, 0xa5
+V1, V2C = 0, 1
+
+INTEGER, OCTET_STRING, NULL, OID = 0x02, 0x04, 0x05, 0x06
+COUNTER, TIME_TICKS, COUNTER64 = 0x41, 0x43, 0x46
+NO_SUCH_OBJECT, NO_SUCH_INSTANCE, END_OF_MIB_VIEW = 0x80, 0x81, 0x82
+NO_SUCH_NAME = 2
+
+MAX_PACKET_SIZE = 2048
+MAX_NR_VALUES = 192
+
+SYS_DESCR = (1, 3, 6, 1, 2, 1, 1, 1, 0)
+SYS_UPTIME = (1, 3, 6, 1, 2, 1, 1, 3, 0)
+IF_IN_OCTETS = (1, 3, 6, 1, 2, 1, 2, 2, 1, 10)
+MEM_TOTAL = (1, 3, 6, 1, 4, 1, 2021, 4, 5, 0)
+DUP_RESENDS = (1, 3, 6, 1, 4, 1, 99999, 100, 6, 0)
+SHED_BULK = (1, 3, 6, 1, 4, 1, 99999, 100, 8, 0)
+GENERATION = (1, 3, 6, 1, 4, 1, 99999, 101, 1, 0)
+CHANGES = (1, 3, 6, 1, 4, 1, 99999, 101, 2)
+
+failures = 0
+
+
+def check(cond, what):
+    global failures
+    if not cond:
+        failures += 1
+    print('%s: %s' % ('ok' if cond else 'FAIL', what))
+
+
+# BER encoding and decoding, just what SNMP needs
+def tlv(tag, val):
+    n = len(val)
+    if n < 0x80:
+        hdr = bytes([n])
+    elif n < 0x100:
+        hdr = bytes([0x81, n])
+    else:
+        hdr = bytes([0x82, n >> 8, n & 0xff])
+    return bytes([tag]) + hdr + val
+
+
+def enc_int(i):
+    return tlv(INTEGER, i.to_bytes(max(1, (i.bit_length() + 8) // 8), 'big', signed=True))
+
+
+def enc_oid(oid):
+    out = bytes([oid[0] * 40 + oid[1]])
+    for sub in oid[2:]:
+        b = [sub & 0x7f]
+        sub >>= 7
+        while sub:
+            b.insert(0, 0x80 | (sub & 0x7f))
+            sub >>= 7
+        out += bytes(b)
+    return tlv(OID, out)
+
+
+def dec_tlv(buf, i):
+    tag, n = buf[i], buf[i + 1]
+    i += 2
+    if n & 0x80:
+        k = n & 0x7f
+        n = int.from_bytes(buf[i:i + k], 'big')
+        i += k
+    return tag, buf[i:i + n], i + n
+
+
+def dec_oid(val):
+    oid, sub = [val[0] // 40, val[0] % 40], 0
+    for c in val[1:]:
+        sub = (sub << 7) | (c & 0x7f)
+        if not c & 0x80:
+            oid.append(sub)
+            sub = 0
+    return tuple(oid)
+
+
+def dec_uint(val):
+    return int.from_bytes(val, 'big')
+
+
+def message(reqid, pdu, oids, version=V2C, nr=0, mr=0):
+    vbs = b''.join(tlv(0x30, enc_oid(oid) + b'\x05\x00') for oid in oids)
+    body = enc_int(reqid) + enc_int(nr) + enc_int(mr) + tlv(0x30, vbs)
+    return tlv(0x30, enc_int(version) + tlv(0x04, b'public') + tlv(pdu, body))
+
+
+def response(buf):
+    """Returns (request-id, error-status, error-index, [(oid, type, value)])"""
+    _, msg, _ = dec_tlv(buf, 0)
+    _, _, i = dec_tlv(msg, 0)
+    _, _, i = dec_tlv(msg, i)
+    tag, pdu, _ = dec_tlv(msg, i)
+    assert tag == RESPONSE
+    _, rid, j = dec_tlv(pdu, 0)
+    _, es, j = dec_tlv(pdu, j)
+    _, ei, j = dec_tlv(pdu, j)
+    _, vbs, _ = dec_tlv(pdu, j)
+    varbinds, k = [], 0
+    while k < len(vbs):
+        _, vb, k = dec_tlv(vbs, k)
+        _, oid, m = dec_tlv(vb, 0)
+        vtype, val, _ = dec_tlv(vb, m)
+        varbinds.append((dec_oid(oid), vtype, val))
+    return int.from_bytes(rid, 'big', signed=True), es[0], ei[0], varbinds
+
+
+class Agent:
+    def __init__(self, binary, *args):
+        self.port = free_port()
+        iface = 'lo' if platform.system() == 'Linux' else 'lo0'
+        cmd = [binary, '-n', '-p', str(self.port), '-P', str(self.port),
+               '-i', iface, '-d', '/', '-t', '1'] + list(args)
+        self.proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.reqid = 0
+        for _ in range(50):
+            try:
+                self.request(GET, [SYS_UPTIME], timeout=0.1)
+                return
+            except socket.timeout:
+                time.sleep(0.1)
+        self.stop()
+        raise RuntimeError('agent did not start: %s' % ' '.join(cmd))
+
+    def stop(self):
+        self.proc.terminate()
+        self.proc.wait()
+
+    def message(self, pdu, oids, version=V2C, nr=0, mr=0):
+        self.reqid += 1
+        return message(self.reqid, pdu, oids, version, nr, mr)
+
+    def send(self, msg, timeout=2):
+        """Sends @msg over UDP, returns the response to it"""
+        reqid = request_id(msg)
+        self.sock.settimeout(timeout)
+        self.sock.sendto(msg, ('127.0.0.1', self.port))
+        while True:
+            buf = self.sock.recv(65535)
+            if response(buf)[0] == reqid:
+                return buf
+
+    def request(self, pdu, oids, version=V2C, nr=0, mr=0, timeout=2):
+        """Returns (error-status, error-index, [(oid, type, value)], size)"""
+        buf = self.send(self.message(pdu, oids, version, nr, mr), timeout)
+        _, es, ei, varbinds = response(buf)
+        return es, ei, varbinds, len(buf)
+
+    def get(self, oid):
+        return dec_uint(self.request(GET, [oid])[2][0][2])
+
+    def walk(self, start=(1, 3), version=V2C, bulk=0):
+        """The varbinds after @start up to the end of the MIB, or of @start's subtree"""
+        result, oid = [], start
+        while True:
+            if bulk:
+                es, _, vbs, _ = self.request(GETBULK, [oid], version, mr=bulk)
+            else:
+                es, _, vbs, _ = self.request(GETNEXT, [oid], version)
+            if es or not vbs:
+                return result
+            for vb in vbs:
+                if vb[1] == END_OF_MIB_VIEW or vb[0][:len(start)] != start and len(start) > 2:
+                    return result
+                result.append(vb)
+                oid = vb[0]
+
+    def connect(self, rcvbuf=0):
+        sd = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        if rcvbuf:
+            sd.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, rcvbuf)
+        sd.settimeout(5)
+        sd.connect(('127.0.0.1', self.port))
+        return sd
+
+
+def request_id(msg):
+    _, body, _ = dec_tlv(msg, 0)
+    _, _, i = dec_tlv(body, 0)
+    _, _, i = dec_tlv(body, i)
+    _, pdu, _ = dec_tlv(body, i)
+    return int.from_bytes(dec_tlv(pdu, 0)[1], 'big', signed=True)
+
+
+def recv_messages(sd, count):
+    """Reads @count messages from the TCP stream @sd"""
+    buf, msgs = b'', []
+    while len(msgs) < count:
+        data = sd.recv(65536)
+        if not data:
+            break
+        buf += data
+        while len(buf) > 4:
+            _, _, end = dec_tlv(buf, 0)
+            if end > len(buf):
+                break
+            msgs.append(buf[:end])
+            buf = buf[end:]
+    return msgs
+
+
+def free_port():
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def oids(varbinds):
+    return [vb[0] for vb in varbinds]
+
+
+def test_tcp(agent):
+    sd = agent.connect()
+    reqs = [agent.message(GET, [SYS_DESCR, SYS_UPTIME]) for _ in range(20)]
+    sd.sendall(b''.join(reqs))
+    resps = recv_messages(sd, len(reqs))
+    check([response(r)[0] for r in resps] == [request_id(r) for r in reqs],
+          'TCP: 20 requests in one write are answered in order')
+    sd.close()
+
+    # A small receive buffer, and not reading until all is sent, makes the
+    # agent queue its responses and write them in pieces
+    sd = agent.connect(rcvbuf=4096)
+    reqs = [agent.message(GETBULK, [(1, 3)], mr=10) for _ in range(100)]
+    sd.sendall(b''.join(reqs))
+    time.sleep(0.5)
+    resps = recv_messages(sd, len(reqs))
+    check([response(r)[0] for r in resps] == [request_id(r) for r in reqs],
+          'TCP: 100 GETBULK responses to a slow reader arrive whole and in order')
+    check(len(set(oids(response(r)[3])[-1] for r in resps)) == 1,
+          'TCP: the responses to a slow reader all walk equally far')
+    sd.close()
+
+
+def closed(sd, timeout):
+    """Whether the agent closes @sd within @timeout seconds"""
+    sd.settimeout(timeout)
+    try:
+        return sd.recv(1) == b''
+    except socket.timeout:
+        return False
+    except ConnectionResetError:
+        return True
+
+
+def test_tcp_clients(agent):
+    """Run with -m 2 -T 2"""
+    first = agent.connect()
+    time.sleep(1.1)
+    second = agent.connect()
+    time.sleep(1.1)
+    first.sendall(agent.message(GET, [SYS_UPTIME]))
+    check(len(recv_messages(first, 1)) == 1, 'TCP: request on the first client')
+    third = agent.connect()
+    check(closed(second, 1), 'TCP: the least recently active client makes room for a new one')
+    check(not closed(first, 0.2), 'TCP: the other clients are kept')
+    check(closed(third, 4), 'TCP: an idle client is disconnected')
+    first.close()
+    second.close()
+    third.close()
+
+
+def test_uptime(agent):
+    es, _, vbs, _ = agent.request(GET, [SYS_DESCR, SYS_UPTIME])
+    check(es == 0 and [vb[1] for vb in vbs] == [OCTET_STRING, TIME_TICKS], 'GET sysDescr.0 and sysUpTime.0')
+    up1 = dec_uint(vbs[1][2])
+    time.sleep(0.2)
+    up2 = agent.get(SYS_UPTIME)
+    check(up2 > up1, 'sysUpTime.0 is computed on each request')
+
+
+def test_walk(agent):
+    full = agent.walk()
+    check(len(full) > 20, 'GETNEXT walk returns the MIB (%d varbinds)' % len(full))
+    check(all(a[0] < b[0] for a, b in zip(full, full[1:])), 'GETNEXT walk is in lexicographic order')
+
+    es, _, vbs, _ = agent.request(GETNEXT, [full[-1][0]])
+    check(vbs and vbs[0][1] == END_OF_MIB_VIEW, 'GETNEXT after the last OID is endOfMibView')
+
+    for mr in (1, 7, 25):
+        bulk = agent.walk(bulk=mr)
+        check(oids(bulk) == oids(full), 'GETBULK walk, max-repetitions %d, matches GETNEXT' % mr)
+
+    return full
+
+
+def test_get(agent, full):
+    found = []
+    for i in range(0, len(full), 10):
+        es, _, vbs, _ = agent.request(GET, oids(full[i:i + 10]))
+        found += [vb for vb in vbs if es == 0 and vb[1] not in (NO_SUCH_OBJECT, NO_SUCH_INSTANCE)]
+    check(oids(found) == oids(full), 'GET finds every OID of the walk')
+
+    missing = (1, 3, 6, 1, 2, 1, 1, 99, 0)
+    es, _, vbs, _ = agent.request(GET, [missing])
+    check(es == 0 and vbs[0][:2] == (missing, NO_SUCH_OBJECT), 'GET of a missing OID is noSuchObject in v2c')
+    es, _, vbs, _ = agent.request(GET, [full[0][0][:-1]])
+    check(es == 0 and vbs[0][1] == NO_SUCH_INSTANCE, 'GET of a prefix of an OID is noSuchInstance in v2c')
+    es, _, _, _ = agent.request(GET, [SYS_DESCR, missing], version=V1)
+    check(es == NO_SUCH_NAME, 'GET of a missing OID is noSuchName in v1')
+
+
+def test_proc(agent):
+    with open('/proc/meminfo') as f:
+        total = [int(line.split()[1]) for line in f if line.startswith('MemTotal:')][0]
+    check(agent.get(MEM_TOTAL) == total, 'memTotalReal.0 is MemTotal of /proc/meminfo')
+
+    # The files are kept open, a refresh must read them anew
+    vbs = agent.walk(start=IF_IN_OCTETS)
+    before = dec_uint(vbs[0][2])
+    time.sleep(1.5)
+    after = agent.get(vbs[0][0])
+    check(after != before, 'ifInOctets of lo changes between refreshes')
+
+
+def test_counter64(agent, full):
+    c64 = [vb for vb in full if vb[1] == COUNTER64]
+    if not c64:
+        print('skip: no Counter64 values in this MIB')
+        return
+    check(all(len(vb[2]) <= 9 for vb in c64), 'Counter64 values are at most 9 bytes')
+    v1 = agent.walk(version=V1)
+    check(oids(v1) == [vb[0] for vb in full if vb[1] != COUNTER64], 'v1 GETNEXT walk skips only the Counter64 values')
+
+
+def test_dedup(agent):
+    """Run with -x 2"""
+    msg = agent.message(GET, [SYS_UPTIME])
+    first = agent.send(msg)
+    time.sleep(0.2)
+    check(agent.send(msg) == first, 'a retransmitted request gets the cached response')
+    check(agent.get(SYS_UPTIME) > dec_uint(response(first)[3][0][2]), 'a new request gets a new response')
+    time.sleep(1.5)
+    check(agent.get(DUP_RESENDS) >= 1, 'the retransmit is counted')
+
+
+def test_shedding(agent):
+    """Run with -R 16384 -o 10"""
+    sd = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    for i in range(500):
+        sd.sendto(message(i, GETBULK, [(1, 3)], mr=20), ('127.0.0.1', agent.port))
+    sd.close()
+    time.sleep(1.5)
+    check(agent.get(SHED_BULK) > 0, 'GETBULK requests are shed under a burst')
+    es, _, vbs, _ = agent.request(GETBULK, [(1, 3)], mr=5)
+    check(es == 0 and len(vbs) == 5, 'GETBULK is served again after the burst')
+
+
+def test_bulk_budget(agent, full):
+    es, _, vbs, size = agent.request(GETBULK, [(1, 3)], mr=1000)
+    check(es == 0 and 0 < len(vbs) <= MAX_NR_VALUES and size <= MAX_PACKET_SIZE,
+          'GETBULK with max-repetitions 1000 is cut short (%d varbinds, %d bytes)' % (len(vbs), size))
+    check(oids(vbs) == oids(full[:len(vbs)]), 'the cut short GETBULK response is a prefix of the walk')
+
+
+def test_bulk_varbinds(agent):
+    """Run with -N 8, walks continue where the budget stopped them"""
+    es, _, vbs, _ = agent.request(GETBULK, [(1, 3)], mr=50)
+    check(es == 0 and len(vbs) == 8, '--bulk-varbinds 8 limits GETBULK to 8 varbinds')
+    check(oids(agent.walk(bulk=50)) == oids(agent.walk()), 'GETBULK walk with --bulk-varbinds 8 matches GETNEXT')
+
+
+def test_bulk_bytes(agent):
+    """Run with -B 200"""
+    es, _, vbs, size = agent.request(GETBULK, [(1, 3)], mr=50)
+    check(es == 0 and vbs and size < 200 + 100, '--bulk-bytes 200 limits the GETBULK response (%d bytes)' % size)
+    check(oids(agent.walk(bulk=50)) == oids(agent.walk()), 'GETBULK walk with --bulk-bytes 200 matches GETNEXT')
+
+
+def test_changes(agent, full):
+    check(not any(vb[0][:len(CHANGES)] == CHANGES for vb in full), 'GETNEXT walk skips the changes column')
+
+    es, _, vbs, _ = agent.request(GET, [GENERATION])
+    check(es == 0 and vbs[0][1] == COUNTER, 'GET of the MIB generation')
+
+    since0 = agent.walk(start=CHANGES + (0,), bulk=10)
+    inner = [vb[0][len(CHANGES) + 1:] for vb in since0]
+    check(since0 and set(inner) <= set(oids(full)), 'walk of .101.2.0 returns MIB entries (%d)' % len(since0))
+    check(all(a < b for a, b in zip(inner, inner[1:])), 'walk of .101.2.0 is in order')
+
+    gen = agent.get(GENERATION)
+    since = agent.walk(start=CHANGES + (gen + 1000000,), bulk=10)
+    check(since == [], 'walk of .101.2.N for a future generation is empty')
+
+
+def run(binary, args, *tests):
+    print('# agent %s' % (' '.join(args) or 'default'))
+    agent = Agent(binary, *args)
+    try:
+        for test in tests:
+            test(agent)
+    finally:
+        agent.stop()
+
+
+def main():
+    binary = sys.argv[1] if len(sys.argv) > 1 else './mini_snmpd'
+    if not os.access(binary, os.X_OK):
+        print('skip: %s not found' % binary)
+        return 77
+    linux = platform.system() == 'Linux'
+
+    modes = [[]]
+    usage = subprocess.run([binary, '-h'], stdout=subprocess.PIPE, stderr=subprocess.STDOUT).stdout
+    if b'--io-uring' in usage:
+        modes.append(['-U'])
+    if linux:
+        modes.append(['-W', '2'])
+    for mode in modes:
+        print('# agent %s' % (' '.join(mode) or 'default'))
+        agent = Agent(binary, *mode)
+        try:
+            test_tcp(agent)
+            test_uptime(agent)
+            full = test_walk(agent)
+            test_get(agent, full)
+            if linux:
+                test_proc(agent)
+            test_counter64(agent, full)
+            test_bulk_budget(agent, full)
+            test_changes(agent, full)
+        finally:
+            agent.stop()
+
+    run(binary, ['-m', '2', '-T', '2'], test_tcp_clients)
+    run(binary, ['-x', '2'], test_dedup)
+    if linux:
+        run(binary, ['-R', '16384', '-o', '10'], test_shedding)
+
+    run(binary, ['-N', '8'], test_bulk_varbinds)
+    run(binary, ['-B', '200'], test_bulk_bytes)
+
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,576 @@
+/* io_uring backend for the UDP and TCP listening sockets
+ *
+ * This file may be distributed and/or modified under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation and appearing in the file LICENSE.GPL included in the
+ * packaging of this file.
+ *
+ * This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+ * WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * See COPYING for GPL licensing information.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "mini_snmpd.h"
+
+/*
+ * The ring keeps a multishot recvmsg armed on the UDP socket, receiving
+ * into a ring of provided buffers, and a multishot accept on the TCP
+ * socket.  Responses are queued as sendmsg SQEs from a pool of send slots
+ * and submitted together with the next wait, so a batch of datagrams costs
+ * one io_uring_enter() rather than a recvfrom() and a sendto() each.
+ *
+ * Everything else, TCP clients, timers, netlink, stays on epoll.  The
+ * epoll descriptor itself is polled by the ring, the caller handles its
+ * events when uring_wait() says so.
+ *
+ * The ring is set up with the raw system calls, liburing is not needed.
+ */
+#define URING_ENTRIES                                   256
+#define URING_BUFFERS                                   64	/* power of 2 */
+#define URING_BUFFER_GROUP                              0
+#define URING_SLOTS                                     64
+#define URING_MAX_ACCEPTED                              64
+
+#define UD_RECV                                         1
+#define UD_ACCEPT                                       2
+#define UD_POLL                                         3
+#define UD_SEND                                         4	/* | slot << 8 */
+
+typedef union {
+	struct sockaddr_in  sa;
+#ifdef CONFIG_ENABLE_IPV6
+	struct sockaddr_in6 sa6;
+#endif
+} uring_addr_t;
+
+/* A received datagram: recvmsg header, peer address, drop count and the packet */
+#define URING_CONTROL_SIZE	CMSG_SPACE(sizeof(uint32_t))
+#define URING_BUFFER_SIZE	(sizeof(struct io_uring_recvmsg_out) + sizeof(uring_addr_t) + URING_CONTROL_SIZE + MAX_PACKET_SIZE)
+
+typedef struct uring_slot_s {
+	struct uring_slot_s *next;
+	client_t             client;
+	uring_addr_t         addr;
+	struct iovec         iov;
+	struct msghdr        msg;
+} uring_slot_t;
+
+static int            m_ring_fd = -1;
+static int            m_epoll_fd = -1;
+
+static void          *m_sq_ring;
+static size_t         m_sq_ring_len;
+static unsigned int  *m_sq_head;
+static unsigned int  *m_sq_tail;
+static unsigned int  *m_sq_mask;
+static unsigned int  *m_sq_array;
+static struct io_uring_sqe *m_sqes;
+static size_t         m_sqes_len;
+static unsigned int   m_sq_queued;
+
+static unsigned int  *m_cq_head;
+static unsigned int  *m_cq_tail;
+static unsigned int  *m_cq_mask;
+static struct io_uring_cqe *m_cqes;
+
+static struct io_uring_buf_ring *m_buf_ring;
+static unsigned char *m_buffers;
+
+static struct msghdr  m_recv_msg;
+static uring_slot_t  *m_slots;
+static uring_slot_t  *m_free_slots;
+
+static int            m_accepted[URING_MAX_ACCEPTED];
+static size_t         m_accepted_len;
+static size_t         m_accepted_pos;
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(unsigned int submit, unsigned int wait, unsigned int flags, void *arg, size_t len)
+{
+	return syscall(__NR_io_uring_enter, m_ring_fd, submit, wait, flags, arg, len);
+}
+
+static int uring_register(unsigned int opcode, void *arg, unsigned int num)
+{
+	return syscall(__NR_io_uring_register, m_ring_fd, opcode, arg, num);
+}
+
+static struct io_uring_sqe *uring_sqe(void)
+{
+	unsigned int head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+	unsigned int tail = *m_sq_tail;
+	struct io_uring_sqe *sqe;
+
+	/* The ring is flushed by every uring_wait(), so this only happens on bursts */
+	if (tail - head > *m_sq_mask) {
+		if (uring_enter(m_sq_queued, 0, 0, NULL, 0) == -1)
+			return NULL;
+		m_sq_queued = 0;
+		head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+		if (tail - head > *m_sq_mask)
+			return NULL;
+	}
+
+	sqe = &m_sqes[tail & *m_sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	m_sq_array[tail & *m_sq_mask] = tail & *m_sq_mask;
+	__atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+	m_sq_queued++;
+
+	return sqe;
+}
+
+static void uring_buffer_put(unsigned int bid)
+{
+	unsigned short tail = m_buf_ring->tail;
+	struct io_uring_buf *buf = &m_buf_ring->bufs[tail & (URING_BUFFERS - 1)];
+
+	buf->addr = (uintptr_t)(m_buffers + bid * URING_BUFFER_SIZE);
+	buf->len  = URING_BUFFER_SIZE;
+	buf->bid  = bid;
+	__atomic_store_n(&m_buf_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int uring_arm_recv(void)
+{
+	struct io_uring_sqe *sqe = uring_sqe();
+
+	if (!sqe)
+		return -1;
+
+	sqe->opcode    = IORING_OP_RECVMSG;
+	sqe->fd        = g_udp_sockfd;
+	sqe->addr      = (uintptr_t)&m_recv_msg;
+	sqe->len       = 1;
+	sqe->ioprio    = IORING_RECV_MULTISHOT;
+	sqe->flags     = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = UD_RECV;
+
+	return 0;
+}
+
+static int uring_arm_accept(void)
+{
+	struct io_uring_sqe *sqe = uring_sqe();
+
+	if (!sqe)
+		return -1;
+
+	sqe->opcode       = IORING_OP_ACCEPT;
+	sqe->fd           = g_tcp_sockfd;
+	sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data    = UD_ACCEPT;
+
+	return 0;
+}
+
+static int uring_arm_poll(void)
+{
+	struct io_uring_sqe *sqe = uring_sqe();
+
+	if (!sqe)
+		return -1;
+
+	sqe->opcode         = IORING_OP_POLL_ADD;
+	sqe->fd             = m_epoll_fd;
+	sqe->poll32_events  = POLLIN;
+	sqe->len            = IORING_POLL_ADD_MULTI;
+	sqe->user_data      = UD_POLL;
+
+	return 0;
+}
+
+/* Answer a datagram, the response is sent with the next submission */
+static void uring_handle_datagram(const unsigned char *buf, size_t len)
+{
+	const struct io_uring_recvmsg_out *out = (const struct io_uring_recvmsg_out *)buf;
+	const size_t head = sizeof(*out) + m_recv_msg.msg_namelen + m_recv_msg.msg_controllen;
+	const unsigned char *name = buf + sizeof(*out);
+	const unsigned char *payload = buf + head;
+	char straddr[my_inet_addrstrlen] = "";
+	struct io_uring_sqe *sqe;
+	struct msghdr control;
+	uring_slot_t *slot;
+	client_t *client;
+
+	if (len < head || (out->flags & MSG_TRUNC) || out->payloadlen > len - head) {
+		lprintf(LOG_WARNING, "Failed receiving UDP request on port %d: truncated\n", g_udp_port);
+		return;
+	}
+
+	memset(&control, 0, sizeof(control));
+	control.msg_control    = (void *)(name + m_recv_msg.msg_namelen);
+	control.msg_controllen = out->controllen;
+	udp_drops_update(&control);
+
+	slot = m_free_slots;
+	if (!slot) {
+		lprintf(LOG_WARNING, "Dropping UDP request, all %d send slots in use\n", URING_SLOTS);
+		return;
+	}
+
+	client = &slot->client;
+	memcpy(&slot->addr, name, out->namelen < sizeof(slot->addr) ? out->namelen : sizeof(slot->addr));
+	memcpy(client->packet, payload, out->payloadlen);
+	client->timestamp = monotonic_time();
+	client->sockfd = g_udp_sockfd;
+	client->addr = ((struct my_sockaddr_t *)&slot->addr)->my_sin_addr;
+	client->port = ((struct my_sockaddr_t *)&slot->addr)->my_sin_port;
+	client->size = out->payloadlen;
+	client->outgoing = 0;
+#ifdef DEBUG
+	dump_packet(client);
+#endif
+
+	inet_ntop(my_af_inet, &client->addr, straddr, sizeof(straddr));
+	switch (dedup_check(client)) {
+	case -1:
+		return;
+
+	case 0:
+		if (snmp_admit(client)) {
+			client->size = 0;
+			dedup_done(client);
+			return;
+		}
+		if (snmp(client) == -1) {
+			lprintf(LOG_WARNING, "Failed UDP request from %s:%d: %m\n", straddr, client->port);
+			client->size = 0;
+		} else if (client->size == 0) {
+			lprintf(LOG_WARNING, "Failed UDP request from %s:%d: ignored\n", straddr, client->port);
+		}
+		dedup_done(client);
+		if (client->size == 0)
+			return;
+		break;
+	}
+	client->outgoing = 1;
+#ifdef DEBUG
+	dump_packet(client);
+#endif
+
+	sqe = uring_sqe();
+	if (!sqe) {
+		lprintf(LOG_WARNING, "Failed UDP response to %s:%d: submission queue full\n", straddr, client->port);
+		return;
+	}
+
+	slot->iov.iov_base    = client->packet;
+	slot->iov.iov_len     = client->size;
+	slot->msg.msg_name    = &slot->addr;
+	slot->msg.msg_namelen = out->namelen < sizeof(slot->addr) ? out->namelen : sizeof(slot->addr);
+	slot->msg.msg_iov     = &slot->iov;
+	slot->msg.msg_iovlen  = 1;
+
+	sqe->opcode    = IORING_OP_SENDMSG;
+	sqe->fd        = g_udp_sockfd;
+	sqe->addr      = (uintptr_t)&slot->msg;
+	sqe->len       = 1;
+	sqe->msg_flags = MSG_DONTWAIT;
+	sqe->user_data = UD_SEND | (uint64_t)(slot - m_slots) << 8;
+
+	m_free_slots = slot->next;
+}
+
+static void uring_handle_sent(uring_slot_t *slot, int res)
+{
+	char straddr[my_inet_addrstrlen] = "";
+
+	if (res < 0 || (size_t)res != slot->client.size) {
+		inet_ntop(my_af_inet, &slot->client.addr, straddr, sizeof(straddr));
+		if (res < 0)
+			lprintf(LOG_WARNING, "Failed UDP response to %s:%d: %s\n", straddr, slot->client.port, strerror(-res));
+		else
+			lprintf(LOG_WARNING, "Failed UDP response to %s:%d: only %d of %zu bytes sent\n",
+				straddr, slot->client.port, res, slot->client.size);
+	}
+
+	slot->next = m_free_slots;
+	m_free_slots = slot;
+}
+
+/* Returns URING_EV_EPOLL if the epoll descriptor is ready, -1 if a multishot request failed */
+static int uring_handle_cqe(const struct io_uring_cqe *cqe)
+{
+	unsigned int more = cqe->flags & IORING_CQE_F_MORE;
+	int ret = 0;
+
+	switch (cqe->user_data & 0xFF) {
+	case UD_RECV:
+		if (cqe->flags & IORING_CQE_F_BUFFER) {
+			unsigned int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+			if (cqe->res > 0)
+				uring_handle_datagram(m_buffers + bid * URING_BUFFER_SIZE, cqe->res);
+			uring_buffer_put(bid);
+		}
+		/* Out of buffers (-ENOBUFS) also ends the multishot, they are back now */
+		if (!more && ((cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -EINTR) || uring_arm_recv()))
+			ret = -1;
+		break;
+
+	case UD_ACCEPT:
+		if (cqe->res >= 0) {
+			if (m_accepted_len < URING_MAX_ACCEPTED)
+				m_accepted[m_accepted_len++] = cqe->res;
+			else
+				close(cqe->res);
+		} else if (cqe->res != -EAGAIN && cqe->res != -EINTR && cqe->res != -ECONNABORTED) {
+			lprintf(LOG_ERR, "Could not accept TCP connection: %s\n", strerror(-cqe->res));
+		}
+		if (!more && ((cqe->res < 0 && cqe->res != -EMFILE && cqe->res != -ENFILE &&
+			       cqe->res != -EAGAIN && cqe->res != -EINTR && cqe->res != -ECONNABORTED) || uring_arm_accept()))
+			ret = -1;
+		break;
+
+	case UD_POLL:
+		if (cqe->res > 0)
+			ret = URING_EV_EPOLL;
+		if (!more && ((cqe->res < 0 && cqe->res != -EINTR) || uring_arm_poll()))
+			ret = -1;
+		break;
+
+	case UD_SEND:
+		uring_handle_sent(&m_slots[cqe->user_data >> 8], cqe->res);
+		break;
+	}
+
+	if (ret == -1)
+		lprintf(LOG_ERR, "io_uring request %llu failed: %s\n", (unsigned long long)cqe->user_data & 0xFF,
+			strerror(cqe->res < 0 ? -cqe->res : EIO));
+
+	return ret;
+}
+
+/*
+ * Submit the queued requests, including the responses, and wait for at
+ * least one completion or @timeout ms (-1 for none).  Returns -1 on error,
+ * else URING_EV_EPOLL when the epoll descriptor has events.
+ */
+int uring_wait(int timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int head, tail;
+	int rc, ret = 0;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.sigmask_sz = _NSIG / 8;
+	if (timeout >= 0) {
+		ts.tv_sec  = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		arg.ts     = (uintptr_t)&ts;
+	}
+
+	rc = uring_enter(m_sq_queued, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	if (rc == -1 && errno != EINTR && errno != ETIME && errno != EBUSY) {
+		lprintf(LOG_ERR, "could not wait for io_uring events: %m\n");
+		return -1;
+	}
+	if (rc >= 0)
+		m_sq_queued -= rc < (int)m_sq_queued ? (unsigned int)rc : m_sq_queued;
+
+	head = *m_cq_head;
+	tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+	udp_load_update((tail - head) * 100 / URING_BUFFERS);
+	while (head != tail) {
+		rc = uring_handle_cqe(&m_cqes[head & *m_cq_mask]);
+		if (rc == -1)
+			ret = -1;
+		else if (ret != -1)
+			ret |= rc;
+
+		head++;
+		__atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+		if (head == tail)
+			tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+	}
+
+	return ret;
+}
+
+/* The next connection accepted by the last uring_wait(), -1 when there are none left */
+int uring_accepted(void)
+{
+	if (m_accepted_pos == m_accepted_len) {
+		m_accepted_pos = m_accepted_len = 0;
+		return -1;
+	}
+
+	return m_accepted[m_accepted_pos++];
+}
+
+static int uring_map(struct io_uring_params *p)
+{
+	size_t sq_len = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+	size_t cq_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+	unsigned char *sq, *cq;
+
+	if (cq_len > sq_len)
+		sq_len = cq_len;
+
+	sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		return -1;
+	cq = sq;
+	m_sq_ring = sq;
+	m_sq_ring_len = sq_len;
+
+	m_sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+	m_sqes = mmap(NULL, m_sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQES);
+	if (m_sqes == MAP_FAILED) {
+		m_sqes = NULL;
+		return -1;
+	}
+
+	m_sq_head  = (unsigned int *)(sq + p->sq_off.head);
+	m_sq_tail  = (unsigned int *)(sq + p->sq_off.tail);
+	m_sq_mask  = (unsigned int *)(sq + p->sq_off.ring_mask);
+	m_sq_array = (unsigned int *)(sq + p->sq_off.array);
+	m_cq_head  = (unsigned int *)(cq + p->cq_off.head);
+	m_cq_tail  = (unsigned int *)(cq + p->cq_off.tail);
+	m_cq_mask  = (unsigned int *)(cq + p->cq_off.ring_mask);
+	m_cqes     = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+
+	return 0;
+}
+
+static int uring_buffers(void)
+{
+	struct io_uring_buf_reg reg;
+	size_t i;
+
+	m_buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (m_buf_ring == MAP_FAILED) {
+		m_buf_ring = NULL;
+		return -1;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr    = (uintptr_t)m_buf_ring;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid         = URING_BUFFER_GROUP;
+	if (uring_register(IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+		return -1;
+
+	m_buffers = allocate(URING_BUFFERS * URING_BUFFER_SIZE);
+	m_slots = allocate(URING_SLOTS * sizeof(uring_slot_t));
+	if (!m_buffers || !m_slots)
+		return -1;
+
+	for (i = 0; i < URING_BUFFERS; i++)
+		uring_buffer_put(i);
+
+	for (i = 0; i < URING_SLOTS; i++) {
+		memset(&m_slots[i], 0, sizeof(m_slots[i]));
+		m_slots[i].next = m_free_slots;
+		m_free_slots = &m_slots[i];
+	}
+
+	/* Only the lengths matter to a multishot recvmsg, it reserves that much in each buffer */
+	memset(&m_recv_msg, 0, sizeof(m_recv_msg));
+	m_recv_msg.msg_namelen = sizeof(uring_addr_t);
+	m_recv_msg.msg_controllen = URING_CONTROL_SIZE;
+
+	return 0;
+}
+
+/* Release everything uring_open() set up, when falling back to epoll */
+static void uring_close(void)
+{
+	/* Closing the ring cancels the armed requests and unregisters the buffer ring */
+	close(m_ring_fd);
+	m_ring_fd = -1;
+	m_epoll_fd = -1;
+
+	if (m_sqes)
+		munmap(m_sqes, m_sqes_len);
+	if (m_sq_ring)
+		munmap(m_sq_ring, m_sq_ring_len);
+	if (m_buf_ring)
+		munmap(m_buf_ring, URING_BUFFERS * sizeof(struct io_uring_buf));
+	m_sqes = NULL;
+	m_sq_ring = NULL;
+	m_buf_ring = NULL;
+	m_sq_queued = 0;
+
+	free(m_buffers);
+	free(m_slots);
+	m_buffers = NULL;
+	m_slots = NULL;
+	m_free_slots = NULL;
+
+	/* Connections accepted while probing for multishot support */
+	while (m_accepted_pos < m_accepted_len)
+		close(m_accepted[m_accepted_pos++]);
+	m_accepted_len = m_accepted_pos = 0;
+}
+
+/*
+ * Set up the ring and arm the requests on the sockets, which must then not
+ * be added to epoll.  Returns -1 if the kernel lacks any of the features,
+ * the caller falls back to epoll for everything.
+ */
+int uring_open(int epoll_fd)
+{
+	const unsigned int features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	m_ring_fd = uring_setup(URING_ENTRIES, &p);
+	if (m_ring_fd == -1) {
+		lprintf(LOG_INFO, "io_uring not available: %m, using epoll\n");
+		return -1;
+	}
+
+	if ((p.features & features) != features) {
+		lprintf(LOG_INFO, "io_uring lacks required features, using epoll\n");
+		goto error;
+	}
+
+	m_epoll_fd = epoll_fd;
+	if (uring_map(&p) || uring_buffers()) {
+		lprintf(LOG_INFO, "io_uring setup failed: %m, using epoll\n");
+		goto error;
+	}
+
+	if (uring_arm_recv() || uring_arm_accept() || uring_arm_poll())
+		goto error;
+
+	/* Kernels without multishot recvmsg or accept fail these right away */
+	if (uring_wait(0) == -1) {
+		lprintf(LOG_INFO, "io_uring lacks multishot support, using epoll\n");
+		goto error;
+	}
+
+	return 0;
+error:
+	uring_close();
+	return -1;
+}
+
+/* vim: ts=4 sts=4 sw=4 nowrap
+ */
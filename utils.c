@@ -15,15 +15,21 @@
 
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/types.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <limits.h>
 #include <syslog.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/sock_diag.h>
+#endif
 
 #include "mini_snmpd.h"
 
@@ -40,65 +46,237 @@ void *allocate(size_t len)
 }
 
 
-static inline int parse_lineint(char *buf, field_t *f)
+/*
+ * Parsing of /proc style files, e.g. /proc/net/dev with one line per
+ * interface, where each line is a prefix followed by a list of numbers:
+ *
+ * - each caller has its own parser, with a hash table of the prefixes of
+ *   its field set, compiled once, so a line costs one lookup regardless
+ *   of the number of fields, interfaces or block devices
+ * - the prefix need not be the first word, e.g. /proc/diskstats starts
+ *   each line with the major and minor device numbers
+ * - the file is kept open and read in one go with pread(), into a buffer
+ *   of the parser's own
+ * - lines are located with memchr()
+ * - numbers are parsed by a plain decimal loop, /proc has no other bases
+ */
+static inline int is_blank(int c)
+{
+	return c == ' ' || c == '\t';
+}
+
+static const char *find_eol(const char *ptr, const char *end)
+{
+	const char *eol = memchr(ptr, '\n', end - ptr);
+
+	return eol ? eol : end;
+}
+
+static uint32_t field_hash(uint32_t hash, const char *key, size_t len)
+{
+	while (len--) {
+		hash ^= (unsigned char)*key++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/* A trailing space only marks the end of the prefix, e.g. "cpu " */
+static size_t field_len(const char *prefix)
+{
+	size_t len = strlen(prefix);
+
+	while (len > 0 && is_blank(prefix[len - 1]))
+		len--;
+
+	return len;
+}
+
+/* Identifies the field set, the fields themselves may point elsewhere each call */
+static uint32_t field_signature(field_t fields[])
 {
-	char *ptr, *prefixptr;
+	uint32_t hash = 2166136261u;
 	size_t i;
 
-	ptr = buf;
-	while (isspace(*ptr))
-		ptr++;
-	if (!*ptr)
-		return 0;
+	for (i = 0; fields[i].prefix; i++)
+		hash = field_hash(hash, fields[i].prefix, strlen(fields[i].prefix) + 1);
 
-	/* Check if buffer begins with prefix */
-	prefixptr = f->prefix;
-	while (*prefixptr) {
-		if (*prefixptr++ != *ptr++)
-			return 0;
+	return hash;
+}
+
+static int parser_compile(parser_t *parser, field_t fields[])
+{
+	size_t i, j, len, num, size = 16;
+
+	for (num = 0; fields[num].prefix; num++)
+		;
+	if (num > UINT16_MAX - 1)
+		return -1;
+
+	/* Keep the load factor at or below 50% */
+	while (size < 2 * num)
+		size <<= 1;
+
+	free(parser->table);
+	parser->table = calloc(size, sizeof(field_slot_t));
+	if (!parser->table)
+		return -1;
+	parser->mask = size - 1;
+
+	for (i = 0; i < num; i++) {
+		len = field_len(fields[i].prefix);
+		j = field_hash(2166136261u, fields[i].prefix, len) & parser->mask;
+		while (parser->table[j].index)
+			j = (j + 1) & parser->mask;
+
+		parser->table[j].index = i + 1;
+		parser->table[j].len   = len;
 	}
-	if (*ptr == ':')	/* Prefix may have a ':', skip it too! */
+
+	return 0;
+}
+
+static const field_t *parser_lookup(const parser_t *parser, field_t fields[], const char *key, size_t len)
+{
+	size_t j = field_hash(2166136261u, key, len) & parser->mask;
+
+	while (parser->table[j].index) {
+		const field_t *f = &fields[parser->table[j].index - 1];
+
+		if (parser->table[j].len == len && !memcmp(f->prefix, key, len))
+			return f;
+		j = (j + 1) & parser->mask;
+	}
+
+	return NULL;
+}
+
+static void parse_line(const char *ptr, const char *eol, const parser_t *parser, field_t fields[])
+{
+	const field_t *f;
+	const char *key;
+	size_t i;
+
+	for (i = 0; i < parser->key; i++) {
+		while (ptr < eol && is_blank(*ptr))
+			ptr++;
+		while (ptr < eol && !is_blank(*ptr))
+			ptr++;
+	}
+
+	while (ptr < eol && is_blank(*ptr))
+		ptr++;
+
+	/* The prefix ends at a ':' or a space, otherwise it is only a partial match */
+	key = ptr;
+	while (ptr < eol && *ptr != ':' && !is_blank(*ptr))
+		ptr++;
+	if (ptr == key)
+		return;
+
+	f = parser_lookup(parser, fields, key, ptr - key);
+	if (!f)
+		return;
+
+	if (ptr < eol && *ptr == ':')
 		ptr++;
-	else if (!isspace(*ptr))/* If there is NO ':' after prefix there must be a space, otherwise we got a partial match */
-		return 0; 
 
 	for (i = 0; i < f->len; i++) {
-		while (isspace(*ptr))
+		unsigned long long val = 0;
+
+		while (ptr < eol && is_blank(*ptr))
 			ptr++;
 
-		if (f->value[i]) {
-			*(f->value[i]) = strtoull(ptr, NULL, 0);
-		}
+		while (ptr < eol && *ptr >= '0' && *ptr <= '9')
+			val = val * 10 + (*ptr++ - '0');
 
-		while (!isspace(*ptr))
+		if (f->value[i] && parser->wide)
+			*(uint64_t *)f->value[i] = val;
+		else if (f->value[i])
+			*(unsigned int *)f->value[i] = val;
+
+		while (ptr < eol && !is_blank(*ptr))
 			ptr++;
 	}
+}
 
-	return 1;
+/* Read all of the file from the start, /proc files have no size so read until EOF */
+static char *parser_read(parser_t *parser, const char *file, size_t *len)
+{
+	ssize_t num;
+
+	if (parser->fd == -1) {
+		parser->fd = open(file, O_RDONLY | O_CLOEXEC);
+		if (parser->fd == -1)
+			return NULL;
+	}
+
+	*len = 0;
+	while (1) {
+		if (parser->size - *len < 2) {
+			size_t new_size = parser->size ? parser->size * 2 : 4096;
+			char *new_buf = realloc(parser->buf, new_size);
+
+			if (!new_buf)
+				return NULL;
+
+			parser->buf  = new_buf;
+			parser->size = new_size;
+		}
+
+		num = pread(parser->fd, parser->buf + *len, parser->size - *len - 1, *len);
+		if (num == -1) {
+			if (errno == EINTR)
+				continue;
+
+			/* Reopen next time, e.g. if the file was replaced */
+			close(parser->fd);
+			parser->fd = -1;
+			return NULL;
+		}
+		if (num == 0)
+			break;
+
+		*len += num;
+	}
+
+	parser->buf[*len] = '\0';
+
+	return parser->buf;
 }
 
-int parse_file(char *file, field_t fields[])
+int parse_file(parser_t *parser, char *file, field_t fields[])
 {
-	char buf[512];
-	FILE *fp;
+	const char *ptr, *end, *eol;
+	uint32_t signature;
+	char *buf;
+	size_t len;
 
-	if (!file || !fields)
+	if (!parser || !file || !fields)
 		return -1;
 
-	fp = fopen(file, "r");
-	if (!fp)
-		return -1;
+	signature = field_signature(fields);
+	if (parser->signature != signature) {
+		if (parser_compile(parser, fields)) {
+			lprintf(LOG_ERR, "Failed parsing %s: cannot compile field set\n", file);
+			return -1;
+		}
+		parser->signature = signature;
+	}
 
-	while (fgets(buf, sizeof(buf), fp)) {
-		int i;
+	buf = parser_read(parser, file, &len);
+	if (!buf)
+		return -1;
 
-		for (i = 0; fields[i].prefix; i++) {
-			if (parse_lineint(buf, &fields[i]))
-				break;
-		}
+	parser->lines = 0;
+	for (ptr = buf, end = buf + len; ptr < end; ptr = eol + 1) {
+		eol = find_eol(ptr, end);
+		parse_line(ptr, eol, parser, fields);
+		parser->lines++;
 	}
 
-	return fclose(fp);
+	return 0;
 }
 
 int read_file(const char *filename, char *buf, size_t size)
@@ -168,32 +346,6 @@ void read_values(const char *buf, const char *prefix, unsigned int *values, int
 	}
 }
 
-int ticks_since(const struct timeval *tv_last, struct timeval *tv_now)
-{
-	float ticks;
-
-	if (gettimeofday(tv_now, NULL) == -1) {
-		lprintf(LOG_WARNING, "could not get ticks: %m\n");
-		return -1;
-	}
-
-	if (tv_now->tv_sec < tv_last->tv_sec || (tv_now->tv_sec == tv_last->tv_sec && tv_now->tv_usec < tv_last->tv_usec)) {
-		lprintf(LOG_WARNING, "could not get ticks: time running backwards\n");
-		return -1;
-	}
-
-	ticks = (float)(tv_now->tv_sec - 1 - tv_last->tv_sec) * 100.0 + (float)((tv_now->tv_usec + 1000000 - tv_last->tv_usec) / 10000);
-#ifdef DEBUG
-	lprintf(LOG_DEBUG, "seconds since last update: %.2f\n", ticks / 100);
-#endif
-	if (ticks < INT_MIN)
-		return INT_MIN;
-	if (ticks > INT_MAX)
-		return INT_MAX;
-
-	return ticks;
-}
-
 #ifdef DEBUG
 void dump_packet(const client_t *client)
 {
@@ -263,12 +415,15 @@ void dump_response(const response_t *response)
 
 char *oid_ntoa(const oid_t *oid)
 {
-	size_t i, len = 0;
-	static char buf[MAX_NR_SUBIDS * 10 + 2];
+	static char buf[MAX_NR_OID_SUBIDS * 10 + 2];
+	unsigned int buffer[MAX_NR_OID_SUBIDS];
+	const unsigned int *subids;
+	size_t i, num, len = 0;
 
+	subids = mib_oid_subids(oid, buffer, &num);
 	buf[0] = '\0';
-	for (i = 0; i < oid->subid_list_length; i++) {
-		len += snprintf(buf + len, sizeof(buf) - len, ".%u", oid->subid_list[i]);
+	for (i = 0; i < num; i++) {
+		len += snprintf(buf + len, sizeof(buf) - len, ".%u", subids[i]);
 		if (len >= sizeof(buf))
 			break;
 	}
@@ -344,20 +499,126 @@ int split(const char *str, char *delim, char **list, int max_list_length)
 	return len;
 }
 
-client_t *find_oldest_client(void)
+/* Convert a clock reading to SNMP TimeTicks, i.e. 1/100 seconds */
+unsigned int timespec_to_ticks(const struct timespec *ts)
+{
+	return (unsigned int)ts->tv_sec * 100 + ts->tv_nsec / 10000000;
+}
+
+/* Time since the first call, which happens at startup */
+unsigned int get_process_uptime(void)
+{
+	static struct timespec start;
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now))
+		return -1;
+
+	if (start.tv_sec == 0 && start.tv_nsec == 0)
+		start = now;
+
+	now.tv_sec -= start.tv_sec;
+	now.tv_nsec -= start.tv_nsec;
+	if (now.tv_nsec < 0) {
+		now.tv_sec--;
+		now.tv_nsec += 1000000000;
+	}
+
+	return timespec_to_ticks(&now);
+}
+
+/* Seconds on CLOCK_MONOTONIC, for timestamps that must not follow the wall clock */
+time_t monotonic_time(void)
 {
-	size_t i, found = 0, pos = 0;
-	time_t timestamp = (time_t)LONG_MAX;
-
-	for (i = 0; i < g_tcp_client_list_length; i++) {
-		if (timestamp > g_tcp_client_list[i]->timestamp) {
-			timestamp = g_tcp_client_list[i]->timestamp;
-			found = 1;
-			pos = i;
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now))
+		return 0;
+
+	return now.tv_sec;
+}
+
+/* Pick up the kernel's count of UDP datagrams dropped, sent along with each one received */
+void udp_drops_update(struct msghdr *msg)
+{
+#ifdef SO_RXQ_OVFL
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL &&
+		    cmsg->cmsg_len >= CMSG_LEN(sizeof(uint32_t)))
+			memcpy(&g_agent.udp_drops, CMSG_DATA(cmsg), sizeof(uint32_t));
+	}
+#else
+	(void)msg;
+#endif
+}
+
+/*
+ * Estimate the UDP backlog, for admission control, as how full the receive
+ * buffer is, or @busy, the share of the event loop's own queue in use, if
+ * higher.  Both in percent.  The buffer is sampled every UDP_LOAD_BATCH
+ * calls, or after UDP_LOAD_AGE ms, not with a system call per request.
+ */
+#define UDP_LOAD_BATCH                                  16
+#define UDP_LOAD_AGE                                    10
+
+void udp_load_update(int busy)
+{
+#ifdef SO_MEMINFO
+	static unsigned int calls;
+	static int64_t sampled;
+	static int load;
+	uint32_t meminfo[SK_MEMINFO_VARS];
+	socklen_t len = sizeof(meminfo);
+	int64_t now;
+#endif
+
+	if (g_shed_watermark <= 0)
+		return;
+
+#ifdef SO_MEMINFO
+	now = sched_now();
+	if (++calls >= UDP_LOAD_BATCH || now - sampled >= UDP_LOAD_AGE) {
+		calls = 0;
+		sampled = now;
+		load = 0;
+		if (!getsockopt(g_udp_sockfd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) && meminfo[SK_MEMINFO_RCVBUF] > 0)
+			load = (uint64_t)meminfo[SK_MEMINFO_RMEM_ALLOC] * 100 / meminfo[SK_MEMINFO_RCVBUF];
+	}
+	if (load > busy)
+		busy = load;
+#endif
+	g_udp_load = busy;
+}
+
+/* The agent's counters, with a fresh sample of the UDP socket buffers */
+void get_agentinfo(agentinfo_t *agentinfo)
+{
+#ifdef SO_MEMINFO
+	uint32_t meminfo[SK_MEMINFO_VARS];
+#endif
+	socklen_t len;
+	int val;
+
+	if (g_udp_sockfd != -1) {
+		len = sizeof(val);
+		if (!getsockopt(g_udp_sockfd, SOL_SOCKET, SO_RCVBUF, &val, &len))
+			g_agent.udp_rcvbuf = val;
+		len = sizeof(val);
+		if (!getsockopt(g_udp_sockfd, SOL_SOCKET, SO_SNDBUF, &val, &len))
+			g_agent.udp_sndbuf = val;
+#ifdef SO_MEMINFO
+		len = sizeof(meminfo);
+		if (!getsockopt(g_udp_sockfd, SOL_SOCKET, SO_MEMINFO, meminfo, &len)) {
+			g_agent.udp_queue = meminfo[SK_MEMINFO_RMEM_ALLOC];
+			if (g_agent.udp_queue > g_agent.udp_queue_max)
+				g_agent.udp_queue_max = g_agent.udp_queue;
 		}
+#endif
 	}
 
-	return found ? g_tcp_client_list[pos] : NULL;
+	*agentinfo = g_agent;
 }
 
 #ifdef CONFIG_ENABLE_DEMO
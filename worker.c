@@ -0,0 +1,331 @@
+/* Protocol workers, handling requests received by the event loop
+ *
+ * This file may be distributed and/or modified under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation and appearing in the file LICENSE.GPL included in the
+ * packaging of this file.
+ *
+ * This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+ * WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * See COPYING for GPL licensing information.
+ */
+#ifdef __linux__
+
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "mini_snmpd.h"
+
+/*
+ * The event loop, the I/O thread, receives the requests and sends the
+ * responses, the workers only run snmp() on them.  Each worker has a pair
+ * of single-producer single-consumer rings: requests in, responses out.
+ *
+ * UDP requests go to the workers round-robin, so a burst from one poller
+ * is spread over all of them.  The requests of a TCP connection all go to
+ * the same worker, its rings keep the responses in order.
+ *
+ * A worker with nothing to do sleeps on its eventfd, and the event loop on
+ * its epoll descriptor.  Each side only wakes the other up when it has said
+ * it is going to sleep, so under load the rings are passed without system
+ * calls.
+ */
+#define WORKER_QUEUE                                    64	/* power of 2 */
+#define WORKER_MAX                                      64
+#define WORKER_STACK                                    (256 * 1024)
+
+typedef struct {
+	unsigned int head __attribute__((aligned(64)));	/* consumer */
+	unsigned int tail __attribute__((aligned(64)));	/* producer */
+	job_t       *slot[WORKER_QUEUE] __attribute__((aligned(64)));
+} ring_t;
+
+typedef struct {
+	ring_t       in;
+	ring_t       out;
+	int          wake;
+	int          sleeping;
+	size_t       inflight;	/* event loop only */
+	pthread_t    thread;
+} worker_t;
+
+static worker_t *m_workers;
+static size_t    m_num_workers;
+static size_t    m_next;
+static size_t    m_done_next;
+
+static job_t    *m_free_jobs;
+static size_t    m_num_jobs;
+static size_t    m_used_jobs;
+static int       m_done_fd = -1;
+static int       m_io_sleeping;
+
+static int ring_push(ring_t *ring, job_t *job)
+{
+	unsigned int tail = ring->tail;
+
+	if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == WORKER_QUEUE)
+		return -1;
+
+	ring->slot[tail & (WORKER_QUEUE - 1)] = job;
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static job_t *ring_pop(ring_t *ring)
+{
+	unsigned int head = ring->head;
+	job_t *job;
+
+	if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	job = ring->slot[head & (WORKER_QUEUE - 1)];
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	return job;
+}
+
+static int ring_empty(ring_t *ring)
+{
+	return ring->head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/* Wake up the other side, if it said it was going to sleep */
+static void wake(int *sleeping, int fd)
+{
+	uint64_t val = 1;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(sleeping, 0, __ATOMIC_SEQ_CST) && write(fd, &val, sizeof(val)) == -1)
+		lprintf(LOG_WARNING, "could not wake up worker: %m\n");
+}
+
+static void worker_handle(job_t *job)
+{
+	client_t *client = &job->client;
+	char straddr[my_inet_addrstrlen] = "";
+	const char *proto = job->owner ? "TCP" : "UDP";
+	int rc;
+
+	mib_lock();
+	rc = snmp(client);
+	mib_unlock();
+
+	if (rc == -1 || client->size == 0) {
+		inet_ntop(my_af_inet, &client->addr, straddr, sizeof(straddr));
+		if (rc == -1)
+			lprintf(LOG_WARNING, "Failed %s request from %s:%d: %m\n", proto, straddr, client->port);
+		else
+			lprintf(LOG_WARNING, "Failed %s request from %s:%d: ignored\n", proto, straddr, client->port);
+		client->size = 0;
+	}
+	client->outgoing = client->size > 0;
+}
+
+static void *worker_thread(void *arg)
+{
+	worker_t *worker = arg;
+	uint64_t val;
+	job_t *job;
+
+	while (1) {
+		job = ring_pop(&worker->in);
+		if (!job) {
+			__atomic_store_n(&worker->sleeping, 1, __ATOMIC_SEQ_CST);
+			if (ring_empty(&worker->in) && read(worker->wake, &val, sizeof(val)) == -1 && errno != EINTR)
+				lprintf(LOG_WARNING, "worker could not sleep: %m\n");
+			__atomic_store_n(&worker->sleeping, 0, __ATOMIC_SEQ_CST);
+			continue;
+		}
+
+		worker_handle(job);
+
+		/* Cannot be full, the event loop never has more jobs out with a worker */
+		ring_push(&worker->out, job);
+		wake(&m_io_sleeping, m_done_fd);
+	}
+
+	return NULL;
+}
+
+/*
+ * Start @num workers.  Returns the descriptor the event loop should wait
+ * on for responses, or -1 on error.
+ */
+int worker_start(int num)
+{
+	pthread_attr_t attr;
+	sigset_t all, old;
+	size_t i, jobs;
+	job_t *job;
+	int rc;
+
+	if (num > WORKER_MAX) {
+		lprintf(LOG_WARNING, "Limiting the number of workers to %d\n", WORKER_MAX);
+		num = WORKER_MAX;
+	}
+
+	/* Cache line aligned, the ring indexes must not share lines */
+	m_num_workers = num;
+	if (posix_memalign((void **)&m_workers, 64, m_num_workers * sizeof(worker_t))) {
+		lprintf(LOG_ERR, "could not allocate workers\n");
+		return -1;
+	}
+
+	jobs = m_num_workers * WORKER_QUEUE;
+	m_num_jobs = jobs;
+	job = allocate(jobs * sizeof(job_t));
+	if (!job)
+		return -1;
+
+	memset(m_workers, 0, m_num_workers * sizeof(worker_t));
+	for (i = 0; i < jobs; i++) {
+		job[i].next = m_free_jobs;
+		m_free_jobs = &job[i];
+	}
+
+	m_done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_done_fd == -1) {
+		lprintf(LOG_ERR, "could not create worker event: %m\n");
+		return -1;
+	}
+
+	/* Enough for snmp() and its response, with --low-latency they are locked in memory */
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, WORKER_STACK);
+
+	for (i = 0; i < m_num_workers; i++) {
+		worker_t *worker = &m_workers[i];
+
+		worker->wake = eventfd(0, EFD_CLOEXEC);
+		if (worker->wake == -1) {
+			lprintf(LOG_ERR, "could not create worker event: %m\n");
+			pthread_attr_destroy(&attr);
+			return -1;
+		}
+
+		/* Signals are for the event loop */
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &old);
+		rc = pthread_create(&worker->thread, &attr, worker_thread, worker);
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		if (rc) {
+			lprintf(LOG_ERR, "could not start worker: %s\n", strerror(rc));
+			pthread_attr_destroy(&attr);
+			return -1;
+		}
+		pthread_detach(worker->thread);
+	}
+	pthread_attr_destroy(&attr);
+
+	return m_done_fd;
+}
+
+/* A free job, NULL if all of them are with the workers */
+job_t *worker_job(void)
+{
+	job_t *job = m_free_jobs;
+
+	if (job) {
+		m_free_jobs = job->next;
+		m_used_jobs++;
+	}
+
+	return job;
+}
+
+void worker_put(job_t *job)
+{
+	job->next = m_free_jobs;
+	m_free_jobs = job;
+	m_used_jobs--;
+}
+
+/* Hand a job to a worker, returns -1 if the worker(s) it may go to are busy */
+int worker_submit(job_t *job)
+{
+	worker_t *worker;
+	size_t i, n;
+
+	for (i = 0; i < m_num_workers; i++) {
+		if (job->owner) {
+			/* Same worker for all requests of a connection */
+			n = ((uintptr_t)job->owner / sizeof(client_t) + job->gen) % m_num_workers;
+		} else {
+			n = m_next;
+			m_next = (m_next + 1) % m_num_workers;
+		}
+
+		worker = &m_workers[n];
+		if (worker->inflight < WORKER_QUEUE && !ring_push(&worker->in, job)) {
+			worker->inflight++;
+			wake(&worker->sleeping, worker->wake);
+			return 0;
+		}
+
+		if (job->owner)
+			break;
+	}
+
+	return -1;
+}
+
+/* The next job the workers are done with, NULL if none */
+job_t *worker_done(void)
+{
+	size_t i, n;
+	job_t *job;
+
+	for (i = 0; i < m_num_workers; i++) {
+		n = m_done_next;
+		job = ring_pop(&m_workers[n].out);
+		if (job) {
+			m_workers[n].inflight--;
+			return job;
+		}
+		m_done_next = (m_done_next + 1) % m_num_workers;
+	}
+
+	return NULL;
+}
+
+/* Share of the jobs in use, in percent */
+int worker_load(void)
+{
+	return m_num_jobs ? m_used_jobs * 100 / m_num_jobs : 0;
+}
+
+/*
+ * The event loop is about to wait, returns 0 if it should not block since
+ * there already are responses to send.
+ */
+int worker_sleep(void)
+{
+	size_t i;
+
+	__atomic_store_n(&m_io_sleeping, 1, __ATOMIC_SEQ_CST);
+	for (i = 0; i < m_num_workers; i++) {
+		if (!ring_empty(&m_workers[i].out)) {
+			__atomic_store_n(&m_io_sleeping, 0, __ATOMIC_SEQ_CST);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+#endif /* __linux__ */
+
+/* vim: ts=4 sts=4 sw=4 nowrap
+ */